@@ -7,19 +7,124 @@
 #include "V3\\LayerEditors\\TerrainEditor.h"
 #include "CTileset.h"
 
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <cassert>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define ISOM_USE_SSE2
+#include <emmintrin.h>
+#endif
+
 
 CIsoMap::CIsoMap( void )
 {
 	this->isomMatchingData	= nullptr;
 
 	this->LastUndoID	= 0xFFFFFFFF;
+	this->openUndoNode			= nullptr;
+	this->undoCellGeneration	= 1;
+	this->undoCoalescing		= false;
 
 	this->mapTerrain	= nullptr;
+
+
+	this->terrainSeed			= 0;
+	this->terrainSeeded			= false;
+	this->finalizeThreadLimit	= 0;
+
+	this->numSubtileTables		= 0;
+	this->subtileTablesTileset	= nullptr;
+
+	this->stagedTilesWidth		= 0;
+	this->stagedTilesHeight		= 0;
+	this->stagedTileGeneration	= 1;
+
+	this->previewActive			= false;
+	this->activeJob				= nullptr;
+
+	this->numHashDescriptors	= 0;
+	this->ResetHashCache();
+	this->ResetStatistics();
 }
 
 CIsoMap::~CIsoMap(void)
 {
-	this->undoNodeTable = nullptr;
+	if (this->activeJob)
+		this->activeJob->isoMap = nullptr;
+	this->SealUndoNode();
+	this->undoCellTable = nullptr;
+}
+
+
+void IsomCounters::Add(	__in const IsomCounters &other )
+{
+	this->nodesEnqueued			+= other.nodesEnqueued;
+	this->duplicatesFiltered	+= other.duplicatesFiltered;
+	this->searchCalls			+= other.searchCalls;
+	this->visitedEarlyExits		+= other.visitedEarlyExits;
+	this->candidatesTested		+= other.candidatesTested;
+	this->diamondsChanged		+= other.diamondsChanged;
+	this->tilesFinalized		+= other.tilesFinalized;
+	this->cliffStackSteps		+= other.cliffStackSteps;
+	this->hashCacheHits			+= other.hashCacheHits;
+	this->hashCacheMisses		+= other.hashCacheMisses;
+	this->undoCellsRecorded		+= other.undoCellsRecorded;
+}
+
+
+#ifdef SI_ISOM_STATISTICS
+
+IsomStatisticsScope::IsomStatisticsScope(	__inout IsomStatistics *statistics,
+											__inout IsomCounters *activeCounters,
+											__in const IsomStatistics::Operation operation )
+{
+	this->statistics		= statistics;
+	this->activeCounters	= activeCounters;
+	this->operation			= operation;
+
+	::memset( this->activeCounters, 0, sizeof(IsomCounters) );
+}
+
+IsomStatisticsScope::~IsomStatisticsScope( void )
+{
+	++this->statistics->numCalls[this->operation];
+	this->statistics->lastCall[this->operation] = *this->activeCounters;
+	this->statistics->totals[this->operation].Add( *this->activeCounters );
+}
+
+#endif
+
+HRESULT CIsoMap::GetStatistics(	__out IsomStatistics *statistics ) const
+{
+	VERIFYARG( statistics );
+
+#ifdef SI_ISOM_STATISTICS
+	*statistics = this->statistics;
+	return S_OK;
+#else
+	::memset( statistics, 0, sizeof(IsomStatistics) );
+	return E_NOTIMPL;
+#endif
+}
+
+void CIsoMap::ResetStatistics( void )
+{
+	::memset( &this->statistics, 0, sizeof(IsomStatistics) );
+	::memset( &this->activeCounters, 0, sizeof(IsomCounters) );
+}
+
+HRESULT CIsoMap::GetHashCacheCounters(	__out size_t *hits,
+										__out size_t *misses ) const
+{
+	VERIFYARG( hits );
+	VERIFYARG( misses );
+
+	*hits	= this->hashCacheHits;
+	*misses	= this->hashCacheMisses;
+	return S_OK;
 }
 
 
@@ -30,12 +135,39 @@ HRESULT CIsoMap::Initialize(	__in MapIsomData *isomMatchingData,
 	VERIFYARG( isomMatchingData );
 	VERIFYARG( mapTerrain );
 
+	if (this->activeJob)
+		return E_PENDING;
+
+	//	The recorded cells refer to the previous map
+	if (this->isomMatchingData)
+		this->SealUndoNode();
+
 	this->isomMatchingData	= isomMatchingData;
 	this->mapTerrain		= mapTerrain;
 
-	hr = ALLOCATE_UNIQUEPTR_ARRAY( undoNodeTable, IsomUndoNode*, this->isomMatchingData->GetWidth() * this->isomMatchingData->GetHeight() );
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( undoCellTable, IsomUndoCell, this->isomMatchingData->GetWidth() * this->isomMatchingData->GetHeight() );
+	RETURNHRSILENT_IF_ERROR( hr );
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( undoCellGenerations, DWORD, this->isomMatchingData->GetWidth() * this->isomMatchingData->GetHeight() );
+	RETURNHRSILENT_IF_ERROR( hr );
+	::memset( this->undoCellGenerations.get(), 0, sizeof(DWORD) * this->isomMatchingData->GetWidth() * this->isomMatchingData->GetHeight() );
+	this->undoCellGeneration = 1;
+
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( cliffStackTop, WORD, this->isomMatchingData->GetWidth() * this->isomMatchingData->GetHeight() );
 	RETURNHRSILENT_IF_ERROR( hr );
-	::memset( this->undoNodeTable.get(), 0, sizeof(IsomUndoNode*) * this->isomMatchingData->GetWidth() * this->isomMatchingData->GetHeight() );
+
+	this->ResetHashCache();
+	this->subtileTablesTileset = nullptr;
+
+	this->stagedTilesWidth	= 0;
+	this->stagedTilesHeight	= 0;
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( stagedTiles, SCEngine::TileIndex, this->mapTerrain->GetWidth() * this->mapTerrain->GetHeight() );
+	RETURNHRSILENT_IF_ERROR( hr );
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( stagedTileGenerations, DWORD, this->mapTerrain->GetWidth() * this->mapTerrain->GetHeight() );
+	RETURNHRSILENT_IF_ERROR( hr );
+	::memset( this->stagedTileGenerations.get(), 0, sizeof(DWORD) * this->mapTerrain->GetWidth() * this->mapTerrain->GetHeight() );
+	this->stagedTilesWidth		= this->mapTerrain->GetWidth();
+	this->stagedTilesHeight		= this->mapTerrain->GetHeight();
+	this->stagedTileGeneration	= 1;
 
 	hr = this->ResetChangedArea();
 	RETURNHRSILENT_IF_ERROR( hr );
@@ -53,159 +185,153 @@ struct EdgeNode
 };
 
 
-HRESULT CIsoMap::FinalizeResize(	__in const __int32 xOffsetTiles,
-									__in const __int32 yOffsetTiles,
-									__in const TileCoordinate oldMapWidth,
-									__in const TileCoordinate oldMapHeight,
-									__in const bool fixBorders )
+//	Collects the diamonds that lie on the border of the area, in row order.
+//	Every other diamond in the area is fully covered by the area's tiles.
+static void CollectAreaBorderDiamonds(	__in const TileRect &area,
+										__out std::vector<POINT> *borderDiamonds )
 {
-	HRESULT hr;
-	VERIFYMEMBER( this->isomMatchingData );
-	VERIFYMEMBER( this->mapTerrain );
+	borderDiamonds->clear();
+	if (area.right < area.left || area.bottom < area.top)
+		return;
 
-	const __int32 xOffset = xOffsetTiles / 2;
-	const __int32 yOffset = yOffsetTiles;
+	for (TileCoordinate y=area.top; y<area.bottom + 1;++y)
+	{
+		bool fullRow = (y == area.top || y == area.bottom);
+		for (TileCoordinate x=area.left + ((area.left + y) % 2);x<area.right + 1;x += 2)
+		{
+			if (! fullRow && x != area.left && x != area.right)
+			{
+				//	Jump straight to the right edge of the area
+				if (x + 2 < area.right)
+					x = area.right - 2 - ((area.right - x) % 2);
+				continue;
+			}
 
-	size_t oldWidth  = MapIsomData::TileXPosToIsomXPos( oldMapWidth )  + 1;
-	size_t oldHeight = MapIsomData::TileYPosToIsomYPos( oldMapHeight ) + 1;
+			POINT borderPt;
+			borderPt.x = x;
+			borderPt.y = y;
+			borderDiamonds->push_back( borderPt );
+		}
+	}
+}
 
-	TileRect	sourceRc;
-	hr = TileRect::CreateOffsettedSourceRect( oldWidth, oldHeight, this->isomMatchingData->GetWidth(), this->isomMatchingData->GetHeight(), xOffset, yOffset, &sourceRc );
-	RETURNHRSILENT_IF_ERROR( hr );
 
-	TileRect innerArea;
-	innerArea.left   = sourceRc.left   + xOffset;
-	innerArea.top    = sourceRc.top    + yOffset;
-	innerArea.right  = sourceRc.right  + xOffset - 1; // -1 since the isom map extends past the tile map by 1
-	innerArea.bottom = sourceRc.bottom + yOffset - 1; // -1 since the isom map extends past the tile map by 1
+template <typename UndoPolicy>
+HRESULT CIsoMap::EnqueueAreaSeam(	__in const TileRect &innerArea,
+									__in const bool fixBorders,
+									__in const UndoPolicy &undo )
+{
+	HRESULT hr;
 
-	//	Mark the inner area as already updated
-	//	We also fix the diamonds on the boundary
+	//	Only the diamonds on the border of the inner area straddle inner and outer data.
+	//	Diamonds further inside are never reached by the matching, since it can only
+	//	step through the border diamonds, which are all marked as changed below.
+	std::vector<POINT> borderDiamonds;
+	CollectAreaBorderDiamonds( innerArea, &borderDiamonds );
 
 	//	In order to make the stack of points which need to be updated
-	//	contain a consistent order, we will spiral out from the center of the offsetted valid data.
-	//	we probably should replace this with a spiral of only the outside row later on
+	//	contain a consistent order, the edge nodes are sorted below.
 	std::vector<EdgeNode> edgeNodes;
 
-	for (size_t y=innerArea.top; y<innerArea.bottom + 1;++y)
+	for (size_t k=0;k<borderDiamonds.size();++k)
 	{
-		for (size_t x=innerArea.left + ((innerArea.left + y) % 2);x<innerArea.right + 1;x += 2)
+		const TileCoordinate x = borderDiamonds[k].x;
+		const TileCoordinate y = borderDiamonds[k].y;
+
+		//	Figure out if the node is fully within the inner area
+		bool fullyInside = true;
+		bool fullyOutside = true;
+		unsigned __int16 isomValue = 0;
+		for (size_t i=0;i<4;i++)
 		{
-			if ((y + x) % 2 != 0)
+			TileCoordinate diamondX = x + diamondXYtoTileXY[i * 2 + 0];
+			TileCoordinate diamondY = y + diamondXYtoTileXY[i * 2 + 1];
+			if (! IsInBounds(diamondX, diamondY))
 				continue;
 
-			//	Figure out if the node is fully within the inner area
-			bool fullyInside = true;
-			bool fullyOutside = true;
-			unsigned __int16 isomValue = 0;
+			if (diamondX >= innerArea.left && diamondX < innerArea.right &&
+				diamondY >= innerArea.top && diamondY < innerArea.bottom )
+			{
+				isomValue = this->isomMatchingData->GetIsomRect( diamondX, diamondY )->GetRawIsomValue( MapIsomData::IsomRect::DirectionIndices[i * 2 + 0] ) >> 4;
+				fullyOutside = false;
+				continue;
+			}
+
+			fullyInside = false;
+		}
+
+		//	Skip diamonds that are completely outside
+		if (fullyOutside)
+			continue;
+
+		//	If the diamond was not fully inside the map, then 
+		//	expand its contents, and add surrounding points to the isom stack
+		if (! fullyInside)
+		{
 			for (size_t i=0;i<4;i++)
 			{
-				TileCoordinate diamondX = x + diamondXYtoTileXY[i * 2 + 0];
-				TileCoordinate diamondY = y + diamondXYtoTileXY[i * 2 + 1];
-				if (! IsInBounds(diamondX, diamondY))
+				TileCoordinate tileX = x + diamondXYtoTileXY[i * 2 + 0];
+				TileCoordinate tileY = y + diamondXYtoTileXY[i * 2 + 1];
+				if (! IsInBounds(tileX, tileY))
 					continue;
 
-				if (diamondX >= innerArea.left && diamondX < innerArea.right &&
-					diamondY >= innerArea.top && diamondY < innerArea.bottom )
+				if (tileX >= innerArea.left && tileX < innerArea.right &&
+					tileY >= innerArea.top && tileY < innerArea.bottom )
 				{
-					unsigned __int16 newIsomValue  = this->isomMatchingData->GetIsomRect( diamondX, diamondY )->GetRawIsomValue( MapIsomData::IsomRect::DirectionIndices[i * 2 + 0] ) >> 4;
-//					unsigned __int16 newIsomValueB = this->isomMatchingData->GetIsomRect( diamondX, diamondY )->GetRawIsomValue( MapIsomData::IsomRect::DirectionIndices[i * 2 + 1] ) >> 4;
-//					if (isomValue != 0 && (newIsomValue != isomValue || newIsomValueB != isomValue))
-//						int brkit = 1;
-
-					isomValue = newIsomValue;
-					fullyOutside = false;
 					continue;
 				}
 
-				fullyInside = false;
+				this->SetTileIsom( tileX, tileY, i, isomValue, undo );
 			}
 
-			//	Skip diamonds that are completely outside
-			if (fullyOutside)
-				continue;
-
-			//	If the diamond was not fully inside the map, then 
-			//	expand its contents, and add surrounding points to the isom stack
-			if (! fullyInside)
+			if (fixBorders)
 			{
 				for (size_t i=0;i<4;i++)
 				{
-					TileCoordinate tileX = x + diamondXYtoTileXY[i * 2 + 0];
-					TileCoordinate tileY = y + diamondXYtoTileXY[i * 2 + 1];
-					if (! IsInBounds(tileX, tileY))
+					TileCoordinate diamondX = x + diamondNeighborOffsets[i * 2 + 0];
+					TileCoordinate diamondY = y + diamondNeighborOffsets[i * 2 + 1];
+					if (! IsInBounds(diamondX, diamondY))
 						continue;
 
-					if (tileX >= innerArea.left && tileX < innerArea.right &&
-						tileY >= innerArea.top && tileY < innerArea.bottom )
+					if (diamondX >= innerArea.left && diamondX < innerArea.right &&
+						diamondY >= innerArea.top && diamondY < innerArea.bottom )
 					{
 						continue;
 					}
 
-					this->SetTileIsom( tileX, tileY, i, isomValue, 0, nullptr );
-				}
+					EdgeNode newNode;
+					newNode.xPos = diamondX;
+					newNode.yPos = diamondY;
+					newNode.matchDistance = 0;
 
-				if (fixBorders)
-				{
-					for (size_t i=0;i<4;i++)
-					{
-						TileCoordinate diamondX = x + diamondNeighborOffsets[i * 2 + 0];
-						TileCoordinate diamondY = y + diamondNeighborOffsets[i * 2 + 1];
-						if (! IsInBounds(diamondX, diamondY))
-							continue;
+					//	Determine number of isom types to traverse to get to the target terrain type
+					MapIsomData::IsomValue targetIsomValue = isomValue; // XXX: hardcoded
+					MapIsomData::IsomGroup targetGroupValue = this->isomMatchingData->isomDataTbl[13 * targetIsomValue + 0];
 
-						if (diamondX >= innerArea.left && diamondX < innerArea.right &&
-							diamondY >= innerArea.top && diamondY < innerArea.bottom )
-						{
-							continue;
-						}
-
-						EdgeNode newNode;
-						newNode.xPos = diamondX;
-						newNode.yPos = diamondY;
-						newNode.matchDistance = 0;
-
-						//	Determine number of isom types to traverse to get to the target terrain type
-						MapIsomData::IsomValue targetIsomValue = isomValue; // XXX: hardcoded
-						MapIsomData::IsomGroup targetGroupValue = this->isomMatchingData->isomDataTbl[13 * targetIsomValue + 0];
-
-						MapIsomData::IsomValue curIsomVal   = this->isomMatchingData->GetIsomValue( diamondX, diamondY );
-						if (curIsomVal * 13UL < this->isomMatchingData->isomDataTableLength)
-						{
-							MapIsomData::IsomGroup curGroupType = this->isomMatchingData->isomDataTbl[13 * curIsomVal + 0];
-
-							++newNode.matchDistance;
-							while (this->isomMatchingData->matchPathCache[this->isomMatchingData->GetNumIsomValues() * curGroupType + targetGroupValue] != targetGroupValue)
-							{
-								curGroupType = this->isomMatchingData->matchPathCache[this->isomMatchingData->GetNumIsomValues() * curGroupType + targetGroupValue];
-								++newNode.matchDistance;
-							}
-						}
-
-						edgeNodes.push_back( newNode );
+					//	Groups with no path get the unreachable distance
+					MapIsomData::IsomValue curIsomVal   = this->isomMatchingData->GetIsomValue( diamondX, diamondY );
+					if (curIsomVal * 13UL < this->isomMatchingData->isomDataTableLength)
+					{
+						MapIsomData::IsomGroup curGroupType = this->isomMatchingData->isomDataTbl[13 * curIsomVal + 0];
+						newNode.matchDistance = (std::max)( this->isomMatchingData->GetMatchDistance( curGroupType, targetGroupValue ), static_cast<size_t>( 1 ) );
 					}
+
+					edgeNodes.push_back( newNode );
 				}
 			}
+		}
 
-			for (size_t i=0;i<4;i++)
-			{
-				TileCoordinate diamondX = x + diamondXYtoTileXY[i * 2 + 0];
-				TileCoordinate diamondY = y + diamondXYtoTileXY[i * 2 + 1];
-				if (! IsInBounds(diamondX, diamondY))
-					continue;
+		for (size_t i=0;i<4;i++)
+		{
+			TileCoordinate diamondX = x + diamondXYtoTileXY[i * 2 + 0];
+			TileCoordinate diamondY = y + diamondXYtoTileXY[i * 2 + 1];
+			if (! IsInBounds(diamondX, diamondY))
+				continue;
 
-				this->isomMatchingData->GetIsomRect( diamondX, diamondY )->SetIsomValueChanged( i );
-			}
+			this->isomMatchingData->GetIsomRect( diamondX, diamondY )->SetIsomValueChanged( i );
 		}
 	}
 
-///	this->SetIsom( 25, 31, 0x0001, 0, nullptr );
-///	this->SetIsom( 15, 57, 0x0001, 0, nullptr );
-///
-///	this->SetIsom( 37, 97, 0x0001, 0, nullptr );
-///	this->SetIsom( 49, 71, 0x0001, 0, nullptr );
-
-
 	//	Order the edge nodes by complexity of the transition and then by distance from the top right
 	std::sort(	edgeNodes.begin(), edgeNodes.end(),
 				[](__in const EdgeNode &a, __in const EdgeNode &b) -> bool
@@ -226,11 +352,6 @@ HRESULT CIsoMap::FinalizeResize(	__in const __int32 xOffsetTiles,
 						return distanceA < distanceB;
 					return a.xPos < b.xPos;
 				} );
-///	EdgeNode temp;
-///	temp.xPos = 25; temp.yPos = 31; edgeNodes.insert( edgeNodes.begin(), temp );
-///	temp.xPos = 15; temp.yPos = 57; edgeNodes.insert( edgeNodes.begin(), temp );
-///	temp.xPos = 37; temp.yPos = 97; edgeNodes.insert( edgeNodes.begin(), temp );
-///	temp.xPos = 49; temp.yPos = 71; edgeNodes.insert( edgeNodes.begin(), temp );
 
 	//	Update the isom data for each edge node one at a time
 	for (size_t k=0;k<edgeNodes.size();++k)
@@ -238,96 +359,86 @@ HRESULT CIsoMap::FinalizeResize(	__in const __int32 xOffsetTiles,
 		hr = this->EnqueueTileUpdate( edgeNodes[k].xPos, edgeNodes[k].yPos );
 		RETURNHRSILENT_IF_ERROR( hr );
 	}
-	{
-		//	And match the terrain
-		size_t numSearches = 0;
-
-		while (! this->isomStack.empty())
-		{
-			MatchNode curNode = this->isomStack.front(); this->isomStack.pop_front();
 
-			++numSearches;
-			if (! this->GetDiamondNeedsUpdate( curNode.position.x, curNode.position.y ) )
-				continue;
+	return S_OK;
+}
 
-			this->SearchForMatch( curNode.position.x, curNode.position.y, 0, nullptr);
-		}
+HRESULT CIsoMap::FinalizeResize(	__in const __int32 xOffsetTiles,
+									__in const __int32 yOffsetTiles,
+									__in const TileCoordinate oldMapWidth,
+									__in const TileCoordinate oldMapHeight,
+									__in const bool fixBorders )
+{
+	HRESULT hr;
+	VERIFYMEMBER( this->isomMatchingData );
+	VERIFYMEMBER( this->mapTerrain );
 
-		//	Reset the changed  and visited area
-		for (TileCoordinate yPosition=changedArea.top;yPosition<=changedArea.bottom;++yPosition)
-		{
-			for (TileCoordinate xPosition=changedArea.left;xPosition<=changedArea.right;xPosition++)
-			{
-				this->isomMatchingData->GetIsomRect( xPosition, yPosition )->ClearChanged();
-			}
-		}
+	if (this->activeJob)
+		return E_PENDING;
 
-		for (size_t y=innerArea.top; y<innerArea.bottom + 1;++y)
-		{
-			for (size_t x=innerArea.left + ((innerArea.left + y) % 2);x<innerArea.right + 1;x += 2)
-			{
-				if ((y + x) % 2 != 0)
-					continue;
+	ISOM_STATISTICS_SCOPE( this, IsomStatistics::OP_FINALIZERESIZE );
 
-				//	Figure out if the node is fully within the inner area
-				bool fullyOutside = true;
-				for (size_t i=0;i<4;i++)
-				{
-					TileCoordinate diamondX = x + diamondXYtoTileXY[i * 2 + 0];
-					TileCoordinate diamondY = y + diamondXYtoTileXY[i * 2 + 1];
-					if (! IsInBounds(diamondX, diamondY))
-						continue;
+	const __int32 xOffset = xOffsetTiles / 2;
+	const __int32 yOffset = yOffsetTiles;
 
-					if (diamondX >= innerArea.left && diamondX < innerArea.right &&
-						diamondY >= innerArea.top && diamondY < innerArea.bottom )
-					{
-						fullyOutside = false;
-						break;
-					}
-				}
+	size_t oldWidth  = MapIsomData::TileXPosToIsomXPos( oldMapWidth )  + 1;
+	size_t oldHeight = MapIsomData::TileYPosToIsomYPos( oldMapHeight ) + 1;
 
-				//	Skip diamonds that are completely outside
-				if (fullyOutside)
-					continue;
+	TileRect	sourceRc;
+	hr = TileRect::CreateOffsettedSourceRect( oldWidth, oldHeight, this->isomMatchingData->GetWidth(), this->isomMatchingData->GetHeight(), xOffset, yOffset, &sourceRc );
+	RETURNHRSILENT_IF_ERROR( hr );
 
-				for (size_t i=0;i<4;i++)
-				{
-					TileCoordinate diamondX = x + diamondXYtoTileXY[i * 2 + 0];
-					TileCoordinate diamondY = y + diamondXYtoTileXY[i * 2 + 1];
-					if (! IsInBounds(diamondX, diamondY))
-						continue;
+	TileRect innerArea;
+	innerArea.left   = sourceRc.left   + xOffset;
+	innerArea.top    = sourceRc.top    + yOffset;
+	innerArea.right  = sourceRc.right  + xOffset - 1; // -1 since the isom map extends past the tile map by 1
+	innerArea.bottom = sourceRc.bottom + yOffset - 1; // -1 since the isom map extends past the tile map by 1
 
-					this->isomMatchingData->GetIsomRect( diamondX, diamondY )->SetIsomValueChanged( i );
-				}
-			}
-		}
-	}
+	hr = this->EnqueueAreaSeam( innerArea, fixBorders, NoUndo() );
+	RETURNHRSILENT_IF_ERROR( hr );
 
+	//	And match the terrain
+	hr = this->PropagateIsomChanges( NoUndo() );
+	RETURNHRSILENT_IF_ERROR( hr );
 	this->isomStack.clear();
 
+	//	The border diamonds are walled off, so the matching only ever visits and changes diamonds outside
+	//	of the inner area. The flags it leaves are on the rects outside of the inner area and on the rects
+	//	along its edge, which the seam flagged. Only those are reset. The rects inside were copied
+	//	without flags by MapIsomData::CopyFrom.
+	for (TileCoordinate y=0;y<this->isomMatchingData->GetHeight();++y)
+	{
+		MapIsomData::IsomRect *row = this->isomMatchingData->GetIsomRect( 0, y );
+		bool innerRow = (y > innerArea.top && y + 1 < innerArea.bottom);
+		for (TileCoordinate x=0;x<this->isomMatchingData->GetWidth();++x)
+		{
+			if (innerRow && x > innerArea.left && x + 1 < innerArea.right)
+			{
+				x = innerArea.right - 2;
+				continue;
+			}
 
+			row[x].ClearChanged();
+		}
+	}
 
-	//	Mark the inner area as unchanged, and all of the new tiles as changed, to trigger a full update
-	//	Mark the inner area as already updated
-	//	Note: we are excluding the right and bottom row, since these are outside of the map bounds.
+	//	Mark all of the new tiles and the border diamonds as changed, to trigger a full update
+	//	of everything outside of the inner area. The inner area itself is left untouched.
 	this->changedArea.left   = this->changedArea.top = 0;
 	this->changedArea.right  = this->isomMatchingData->GetWidth() - 1;
 	this->changedArea.bottom = this->isomMatchingData->GetHeight() - 1;
-	for (size_t y=innerArea.top;y<innerArea.bottom;++y)
-	{
-		for (size_t x=innerArea.left;x<innerArea.right;++x)
-		{
-			MapIsomData::IsomRect *targetRect = this->isomMatchingData->GetIsomRect( x, y );
-			targetRect->ClearChanged();
-		}
-	}
 
-	for (size_t y=0;y<this->isomMatchingData->GetHeight();++y)
+	for (TileCoordinate y=0;y<this->isomMatchingData->GetHeight();++y)
 	{
-		for (size_t x=0 + (y % 2);x<this->isomMatchingData->GetWidth();x += 2)
+		bool innerRow = (y > innerArea.top && y < innerArea.bottom);
+		for (TileCoordinate x=0 + (y % 2);x<this->isomMatchingData->GetWidth();x += 2)
 		{
-			if ((y + x) % 2 != 0)
+			//	Skip over the diamonds which can only be fully inside
+			if (innerRow && x > innerArea.left && x < innerArea.right)
+			{
+				x = innerArea.right - 2 + ((innerArea.right - x) % 2);
 				continue;
+			}
 
 			//	Figure out if the node is fully within the inner area
 			bool fullyInside = true;
@@ -379,6 +490,9 @@ HRESULT CIsoMap::CopyFrom(	__inout MapIsomData *isomData,
 	VERIFYARG( isomData );
 	VERIFYMEMBER( isomMatchingData );
 
+	if (this->activeJob)
+		return E_PENDING;
+
 	if (undoID && undoList)
 	{
 		const __int32 xOffset = xOffsetTiles / 2;
@@ -388,16 +502,50 @@ HRESULT CIsoMap::CopyFrom(	__inout MapIsomData *isomData,
 		hr = TileRect::CreateOffsettedSourceRect( isomData->GetWidth(), isomData->GetHeight(), this->isomMatchingData->GetWidth(), this->isomMatchingData->GetHeight(), xOffset, yOffset, &sourceRc );
 		RETURNHRSILENT_IF_ERROR( hr );
 
-		for (TileCoordinate y=0;y < this->isomMatchingData->GetHeight();++y)
+		//	Only the rects that get written are snapshotted: the copied rect, and the strips past the
+		//	source that are reset to 0 below. The copied rect is cut off at the strips, which
+		//	overwrite it, so none of the areas overlap.
+		const TileCoordinate keptWidth	= static_cast<TileCoordinate>( (std::min)( isomData->GetWidth(), this->isomMatchingData->GetWidth() ) );
+		const TileCoordinate keptHeight	= static_cast<TileCoordinate>( (std::min)( isomData->GetHeight(), this->isomMatchingData->GetHeight() ) );
+
+		TileRect	snapshotAreas[3];
+		size_t		numSnapshotAreas = 0;
+
+		TileRect copyArea;
+		copyArea.left	= sourceRc.left + xOffset;
+		copyArea.top	= sourceRc.top + yOffset;
+		copyArea.right	= (std::min)( static_cast<TileCoordinate>( sourceRc.right + xOffset ), keptWidth );
+		copyArea.bottom	= (std::min)( static_cast<TileCoordinate>( sourceRc.bottom + yOffset ), keptHeight );
+		if (copyArea.left < copyArea.right && copyArea.top < copyArea.bottom)
 		{
-			for (TileCoordinate x=0;x < this->isomMatchingData->GetWidth();++x)
-			{
-				hr = this->PrepareUndoNode( x, y, undoID, undoList );
-				RETURNHRSILENT_IF_ERROR( hr );
-			}
+			copyArea.right	-= 1;
+			copyArea.bottom	-= 1;
+			snapshotAreas[numSnapshotAreas++] = copyArea;
+		}
+
+		if (keptWidth < this->isomMatchingData->GetWidth() && keptHeight > 0)
+		{
+			TileRect &rightStrip = snapshotAreas[numSnapshotAreas++];
+			rightStrip.left		= keptWidth;
+			rightStrip.top		= 0;
+			rightStrip.right	= this->isomMatchingData->GetWidth() - 1;
+			rightStrip.bottom	= keptHeight - 1;
+		}
+
+		if (keptHeight < this->isomMatchingData->GetHeight())
+		{
+			TileRect &bottomStrip = snapshotAreas[numSnapshotAreas++];
+			bottomStrip.left	= 0;
+			bottomStrip.top		= keptHeight;
+			bottomStrip.right	= this->isomMatchingData->GetWidth() - 1;
+			bottomStrip.bottom	= this->isomMatchingData->GetHeight() - 1;
 		}
 
-		hr = this->isomMatchingData->CopyFrom( isomData, xOffset, yOffset );
+		std::unique_ptr<MapIsomData::IsomRect[]> snapshot;
+		hr = this->BeginUndoSnapshot( snapshotAreas, numSnapshotAreas, &snapshot );
+		RETURNHRSILENT_IF_ERROR( hr );
+
+		hr = this->isomMatchingData->CopyFrom( isomData, xOffsetTiles, yOffsetTiles );
 		RETURNHRSILENT_IF_ERROR( hr );
 
 		//	Reset isom values that will be clipped after resizing to 0.
@@ -428,19 +576,8 @@ HRESULT CIsoMap::CopyFrom(	__inout MapIsomData *isomData,
 			}
 		}
 
-		for (TileCoordinate y=0;y < this->isomMatchingData->GetHeight();++y)
-		{
-			for (TileCoordinate x=0;x < this->isomMatchingData->GetWidth();++x)
-			{
-				IsomUndoNode *undoNode = this->undoNodeTable[x + y * this->isomMatchingData->GetWidth()];
-				MapIsomData::IsomRect *targetRect = this->isomMatchingData->GetIsomRect( x, y );
-
-				undoNode->newSettings.isom.SetRawIsomValue(0, targetRect->GetRawIsomValue(0) );
-				undoNode->newSettings.isom.SetRawIsomValue(1, targetRect->GetRawIsomValue(1) );
-				undoNode->newSettings.isom.SetRawIsomValue(2, targetRect->GetRawIsomValue(2) );
-				undoNode->newSettings.isom.SetRawIsomValue(3, targetRect->GetRawIsomValue(3) );
-			}
-		}
+		hr = this->CommitUndoSnapshot( snapshotAreas, numSnapshotAreas, snapshot.get(), undoID, undoList );
+		RETURNHRSILENT_IF_ERROR( hr );
 	}
 	else
 	{
@@ -461,412 +598,3074 @@ HRESULT CIsoMap::PrepareUndoNode(	__in const TileCoordinate tileX,
 									__in const DWORD undoID,
 									__in CScmdraftUndo *undoList )
 {
+	HRESULT hr;
 	VERIFYARG( undoList );
 
-	if (undoID != this->LastUndoID)
+	//	While coalescing, later undo IDs keep recording into the node of the stroke
+	if (! this->openUndoNode || (undoID != this->LastUndoID && ! this->undoCoalescing))
 	{
-		this->LastUndoID = undoID;
-		::memset( this->undoNodeTable.get(), 0, sizeof(IsomUndoNode*) * this->isomMatchingData->GetWidth() * this->isomMatchingData->GetHeight() );
+		hr = this->OpenUndoNode( undoID, undoList );
+		RETURNHRSILENT_IF_ERROR( hr );
 	}
 
-	if (this->undoNodeTable[tileX + tileY * this->isomMatchingData->GetWidth()] )
+	const size_t cellOffset = tileX + tileY * this->isomMatchingData->GetWidth();
+	if (this->GetUndoCell( cellOffset ))
 		return S_OK;
 
-	IsomUndoNode *undoNode = new (std::nothrow) IsomUndoNode;
-	if (! undoNode)
-		return E_OUTOFMEMORY;
+	this->undoCells.push_back( cellOffset );
+	ISOM_COUNT( undoCellsRecorded );
 
-	undoNode->xPos = tileX;
-	undoNode->yPos = tileY;
+	IsomUndoCell *undoCell = &this->undoCellTable[cellOffset];
+	this->undoCellGenerations[cellOffset] = this->undoCellGeneration;
 
 	MapIsomData::IsomRect *targetRect = this->isomMatchingData->GetIsomRect( tileX, tileY );
-	undoNode->oldSettings.isom.SetRawIsomValue(0, targetRect->GetRawIsomValue(0) );
-	undoNode->oldSettings.isom.SetRawIsomValue(1, targetRect->GetRawIsomValue(1) );
-	undoNode->oldSettings.isom.SetRawIsomValue(2, targetRect->GetRawIsomValue(2) );
-	undoNode->oldSettings.isom.SetRawIsomValue(3, targetRect->GetRawIsomValue(3) );
-
-	this->undoNodeTable[tileX + tileY * this->isomMatchingData->GetWidth()] = undoNode;
-	undoList->AddUndoNode( undoID, std::unique_ptr<IsomUndoNode>( undoNode ) );
+	for (size_t i=0;i<4;i++)
+	{
+		undoCell->oldRect.SetRawIsomValue( i, targetRect->GetRawIsomValue(i) );
+		undoCell->newRect.SetRawIsomValue( i, targetRect->GetRawIsomValue(i) );
+	}
 
 	return S_OK;
 }
 
+IsomUndoCell *CIsoMap::GetUndoCell(	__in const size_t cellOffset ) const
+{
+	if (this->undoCellGenerations[cellOffset] != this->undoCellGeneration)
+		return nullptr;
 
-HRESULT CIsoMap::SetDiamondIsom(	__in const TileCoordinate diamondX,
-									__in const TileCoordinate diamondY,
-									__in const MapIsomData::IsomValue isomVal,
-									__in const DWORD undoID,
-									__in CScmdraftUndo *undoList )
+	return &this->undoCellTable[cellOffset];
+}
+
+HRESULT CIsoMap::OpenUndoNode(	__in const DWORD undoID,
+								__in CScmdraftUndo *undoList )
 {
 	HRESULT hr;
 
-	for (size_t curDir=0;curDir<4;++curDir)
-	{
-		TileCoordinate tileX = diamondX + diamondXYtoTileXY[curDir * 2 + 0];
-		TileCoordinate tileY = diamondY + diamondXYtoTileXY[curDir * 2 + 1];
-		if (! IsInBounds( tileX, tileY ))
-			continue;
+	this->SealUndoNode();
 
-		hr = this->SetTileIsom(tileX, tileY, curDir, isomVal, undoID, undoList);
-		RETURNHRSILENT_IF_ERROR( hr );
-	}
+	IsomUndoNode *undoNode = new (std::nothrow) IsomUndoNode;
+	if (! undoNode)
+		return E_OUTOFMEMORY;
+
+	undoNode->isoMap	= this;
+	this->openUndoNode	= undoNode;
+	this->LastUndoID	= undoID;
+
+	//	Takes ownership, and detaches the node again if it can't keep it
+	hr = undoList->AddUndoNode( undoID, std::unique_ptr<IsomUndoNode>( undoNode ) );
+	RETURNHRSILENT_IF_ERROR( hr );
 
 	return S_OK;
 }
 
+//	Unchanged rects an undo run may span, a new run header costs about as much
+static const size_t MAX_UNDO_RUN_GAP = 4;
 
-HRESULT CIsoMap::SetTileIsom(	__in const TileCoordinate tileX,
-								__in const TileCoordinate tileY,
-								__in const size_t dir,
-								__in const MapIsomData::IsomValue isomVal,
-								__in const DWORD undoID,
-								__in CScmdraftUndo *undoList )
+//	Starts a run of neighboring rects in the data of an undo node, in the format described at IsomUndoNode.
+//	Returns where the masks of the run start.
+static size_t BeginUndoRun(	__inout std::vector<WORD> *data,
+							__in const TileCoordinate runX,
+							__in const TileCoordinate runY,
+							__in const size_t numRunCells )
 {
-	HRESULT hr;
-	UNREFERENCED_PARAMETER( hr );
+	data->push_back( static_cast<WORD>( runX ) );
+	data->push_back( static_cast<WORD>( runY ) );
+	data->push_back( static_cast<WORD>( numRunCells ) );
 
-	MapIsomData::IsomRect *targetRect = this->isomMatchingData->GetIsomRect( tileX, tileY );
+	const size_t maskIndex = data->size();
+	data->resize( data->size() + (numRunCells + 3) / 4, 0 );
+	return maskIndex;
+}
 
-	IsomUndoNode *undoNode = nullptr;
-	if (undoList && this->undoNodeTable)
+static void AppendUndoRect(	__inout std::vector<WORD> *data,
+							__in const size_t maskIndex,
+							__in const size_t cellIndex,
+							__in const MapIsomData::IsomRect &oldRect,
+							__in const MapIsomData::IsomRect &newRect )
+{
+	for (size_t valueIndex=0;valueIndex<4;valueIndex++)
 	{
-		this->PrepareUndoNode( tileX, tileY, undoID, undoList );
-		undoNode = this->undoNodeTable[tileX + tileY * this->isomMatchingData->GetWidth()];
+		const WORD delta = oldRect.GetRawIsomValue( valueIndex ) ^ newRect.GetRawIsomValue( valueIndex );
+		if (delta == 0)
+			continue;
+
+		(*data)[maskIndex + cellIndex / 4] |= static_cast<WORD>( 1 << ((cellIndex % 4) * 4 + valueIndex) );
+		data->push_back( delta );
 	}
+}
 
-	targetRect->SetIsomValue( dir, isomVal );
-	targetRect->SetIsomValueChanged( dir );
-	targetRect->ClearDirVisited( dir );
+//	A run of recorded cells
+static void AppendUndoRun(	__inout std::vector<WORD> *data,
+							__in const TileCoordinate runX,
+							__in const TileCoordinate runY,
+							__in const size_t numRunCells,
+							__in const IsomUndoCell *undoCells )
+{
+	const size_t maskIndex = BeginUndoRun( data, runX, runY, numRunCells );
+	for (size_t cellIndex=0;cellIndex<numRunCells;cellIndex++)
+		AppendUndoRect( data, maskIndex, cellIndex, undoCells[cellIndex].oldRect, undoCells[cellIndex].newRect );
+}
 
-	if (undoNode)
+//	A run of a snapshot row against the same row of the map
+static void AppendUndoRun(	__inout std::vector<WORD> *data,
+							__in const TileCoordinate runX,
+							__in const TileCoordinate runY,
+							__in const size_t numRunCells,
+							__in const MapIsomData::IsomRect *oldRects,
+							__in const MapIsomData::IsomRect *newRects )
+{
+	const size_t maskIndex = BeginUndoRun( data, runX, runY, numRunCells );
+	for (size_t cellIndex=0;cellIndex<numRunCells;cellIndex++)
+		AppendUndoRect( data, maskIndex, cellIndex, oldRects[cellIndex], newRects[cellIndex] );
+}
+
+//	Flags are not part of the undo data
+static bool HasRawIsomChange(	__in const MapIsomData::IsomRect &oldRect,
+								__in const MapIsomData::IsomRect &newRect )
+{
+	for (size_t valueIndex=0;valueIndex<4;valueIndex++)
 	{
-		undoNode->newSettings.isom.SetRawIsomValue(0, targetRect->GetRawIsomValue(0) );
-		undoNode->newSettings.isom.SetRawIsomValue(1, targetRect->GetRawIsomValue(1) );
-		undoNode->newSettings.isom.SetRawIsomValue(2, targetRect->GetRawIsomValue(2) );
-		undoNode->newSettings.isom.SetRawIsomValue(3, targetRect->GetRawIsomValue(3) );
+		if (oldRect.GetRawIsomValue( valueIndex ) != newRect.GetRawIsomValue( valueIndex ))
+			return true;
 	}
+	return false;
+}
 
-	this->changedArea.left   = (std::min)(this->changedArea.left,   tileX );
-	this->changedArea.right  = (std::max)(this->changedArea.right,  tileX );
-	this->changedArea.top    = (std::min)(this->changedArea.top,    tileY );
-	this->changedArea.bottom = (std::max)(this->changedArea.bottom, tileY );
+void CIsoMap::SealUndoNode( void )
+{
+	IsomUndoNode *undoNode = this->openUndoNode;
+	if (! undoNode)
+		return;
 
-	return S_OK;
+	//	Row order, so each run is a stretch of neighboring cells
+	std::sort( this->undoCells.begin(), this->undoCells.end() );
+
+	const size_t width = this->isomMatchingData->GetWidth();
+	std::vector<WORD> &data = this->undoEncodeBuffer;
+	data.clear();
+
+	size_t i = 0;
+	while (i < this->undoCells.size())
+	{
+		const size_t firstCell = this->undoCells[i];
+		if (::memcmp( &this->undoCellTable[firstCell].oldRect, &this->undoCellTable[firstCell].newRect, sizeof(MapIsomData::IsomRect) ) == 0)
+		{
+			++i;
+			continue;
+		}
+
+		size_t lastCell = firstCell;
+		for (++i;i<this->undoCells.size();++i)
+		{
+			const size_t cellOffset = this->undoCells[i];
+			if (cellOffset / width != firstCell / width || cellOffset - lastCell > MAX_UNDO_RUN_GAP + 1)
+				break;
+
+			if (::memcmp( &this->undoCellTable[cellOffset].oldRect, &this->undoCellTable[cellOffset].newRect, sizeof(MapIsomData::IsomRect) ) != 0)
+				lastCell = cellOffset;
+		}
+
+		//	Cells the run spans without having been recorded hold stale values, make them unchanged
+		const size_t numRunCells = lastCell - firstCell + 1;
+		for (size_t cellOffset=firstCell;cellOffset<=lastCell;cellOffset++)
+		{
+			if (! this->GetUndoCell( cellOffset ))
+				this->undoCellTable[cellOffset].newRect = this->undoCellTable[cellOffset].oldRect;
+		}
+
+		AppendUndoRun( &data, firstCell % width, firstCell / width, numRunCells, &this->undoCellTable[firstCell] );
+	}
+	this->StoreUndoData( undoNode );
+
+	this->DetachUndoNode();
+
+	//	Only fails to write the spill file, the data then just stays in memory
+	this->undoSpill.Track( undoNode );
 }
 
-void CIsoMap::PlaceFinalTerrain(	__in const TileCoordinate X,
-									__in const TileCoordinate Y,
-									__in TerrainLayer &terrainLayerEditor )
+void CIsoMap::StoreUndoData(	__inout IsomUndoNode *undoNode )
+{
+	undoNode->spillWords = this->undoEncodeBuffer.size();
+	if (undoNode->spillWords == 0)
+		return;
+
+	//	Out of memory leaves the node without data, which Apply reports
+	if (SUCCEEDED( ALLOCATE_UNIQUEPTR_ARRAY( undoNode->data, WORD, undoNode->spillWords ) ))
+		::memcpy( undoNode->data.get(), this->undoEncodeBuffer.data(), undoNode->spillWords * sizeof(WORD) );
+}
+
+void CIsoMap::DetachUndoNode( void )
+{
+	if (this->openUndoNode)
+		this->openUndoNode->isoMap = nullptr;
+	this->openUndoNode = nullptr;
+	this->undoCells.clear();
+
+	//	Bumping the generation forgets every recorded cell at once
+	++this->undoCellGeneration;
+	if (this->undoCellGeneration == 0)
+	{
+		::memset( this->undoCellGenerations.get(), 0, sizeof(DWORD) * this->isomMatchingData->GetWidth() * this->isomMatchingData->GetHeight() );
+		this->undoCellGeneration = 1;
+	}
+}
+
+HRESULT CIsoMap::BeginUndoSnapshot(	__in const TileRect *areas,
+									__in const size_t numAreas,
+									__out std::unique_ptr<MapIsomData::IsomRect[]> *snapshot )
 {
 	HRESULT hr;
+	VERIFYARG( areas );
+	VERIFYARG( snapshot );
+	VERIFYMEMBER( this->isomMatchingData );
 
-	if (X + 1 >= this->isomMatchingData->GetWidth() || Y + 1 >= this->isomMatchingData->GetHeight())
-		return;
+	size_t snapshotLength = 0;
+	for (size_t i=0;i<numAreas;++i)
+	{
+		const TileRect &area = areas[i];
+		if (area.right < area.left || area.bottom < area.top ||
+			area.right >= this->isomMatchingData->GetWidth() || area.bottom >= this->isomMatchingData->GetHeight())
+		{
+			return E_INVALIDARG;
+		}
 
-	const SI_CTileset *tileset = this->mapTerrain->GetTileset();
+		snapshotLength += (area.right - area.left + 1) * (area.bottom - area.top + 1);
+	}
 
-	DWORD TileHash = GetTileHash(X, Y);
-	const std::vector<CMegaGroupNode>	*potentialTileList = tileset->GetHashArray(TileHash);
-	
-	if (potentialTileList != NULL)
+	//	Nodes are applied in order, so anything recorded before the bulk change goes first
+	this->SealUndoNode();
+
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( (*snapshot), MapIsomData::IsomRect, snapshotLength );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	MapIsomData::IsomRect *snapshotRow = snapshot->get();
+	for (size_t i=0;i<numAreas;++i)
 	{
-		unsigned __int16 destTileGroup = (*potentialTileList)[0].groupIndex;
+		const TileRect &area = areas[i];
+		const size_t areaWidth = area.right - area.left + 1;
+		for (TileCoordinate y=area.top;y<=area.bottom;++y,snapshotRow += areaWidth)
+			::memcpy( snapshotRow, this->isomMatchingData->GetIsomRect( area.left, y ), areaWidth * sizeof(MapIsomData::IsomRect) );
+	}
+
+	return S_OK;
+}
+
+HRESULT CIsoMap::CommitUndoSnapshot(	__in const TileRect *areas,
+										__in const size_t numAreas,
+										__in const MapIsomData::IsomRect *snapshot,
+										__in const DWORD undoID,
+										__in CScmdraftUndo *undoList )
+{
+	HRESULT hr;
+	VERIFYARG( areas );
+	VERIFYARG( snapshot );
+	VERIFYARG( undoList );
+	VERIFYMEMBER( this->isomMatchingData );
+
+	this->SealUndoNode();
+
+	std::unique_ptr<IsomUndoNode> undoNode( new (std::nothrow) IsomUndoNode );
+	if (! undoNode)
+		return E_OUTOFMEMORY;
 
-		//	Use the tile row above the current one to determine the exact type of tile group to use
-		//	Random guess: this facilitates cliff stacking
-		if (Y != 0)
+	//	Diff each row of the snapshot against the map, the same runs as a sealed node
+	this->undoEncodeBuffer.clear();
+	const MapIsomData::IsomRect *oldRow = snapshot;
+	for (size_t i=0;i<numAreas;++i)
+	{
+		const TileRect &area = areas[i];
+		const size_t areaWidth = area.right - area.left + 1;
+		for (TileCoordinate y=area.top;y<=area.bottom;++y,oldRow += areaWidth)
 		{
-			const TerrainData::TileGroupInfo *prvRowTileGroupInfo = tileset->GetTileGroup( this->mapTerrain->GetBaseTileIndex(X * 2, Y - 1) );
-			if (prvRowTileGroupInfo)
+			const MapIsomData::IsomRect *newRow = this->isomMatchingData->GetIsomRect( area.left, y );
+
+			size_t x = 0;
+			while (x < areaWidth)
 			{
-				unsigned __int16 prvRowTileGroupMatching = prvRowTileGroupInfo->intraGroupMatching[3];
-				for (size_t i=0;i<potentialTileList->size();++i)
+				if (! HasRawIsomChange( oldRow[x], newRow[x] ))
 				{
-					if ((*potentialTileList)[i].tileGroupRef->intraGroupMatching[1] != prvRowTileGroupMatching)
-						continue;
+					++x;
+					continue;
+				}
 
-					destTileGroup = (*potentialTileList)[i].groupIndex;
-					break;
+				const size_t firstX = x;
+				size_t lastX = x;
+				for (++x;x<areaWidth && x - lastX <= MAX_UNDO_RUN_GAP + 1;++x)
+				{
+					if (HasRawIsomChange( oldRow[x], newRow[x] ))
+						lastX = x;
 				}
+
+				AppendUndoRun( &this->undoEncodeBuffer, area.left + firstX, y, lastX - firstX + 1, &oldRow[firstX], &newRow[firstX] );
 			}
 		}
+	}
+	this->StoreUndoData( undoNode.get() );
+	this->undoSpill.Track( undoNode.get() );
+
+	this->LastUndoID = undoID;
+	hr = undoList->AddUndoNode( undoID, std::move( undoNode ) );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	return S_OK;
+}
+
+HRESULT CIsoMap::BeginUndoCoalescing( void )
+{
+	if (this->undoCoalescing)
+		return E_FAIL;
+
+	//	The stroke gets a node of its own
+	this->SealUndoNode();
+	this->undoCoalescing = true;
+	return S_OK;
+}
+
+HRESULT CIsoMap::EndUndoCoalescing( void )
+{
+	if (! this->undoCoalescing)
+		return E_FAIL;
 
-		//	Set the actual tile values
-		unsigned __int16 destSubTile;
-		tileset->GetRandomSubtile(destTileGroup, &destSubTile);
-		destSubTile = destSubTile % 16;
+	this->undoCoalescing = false;
+	this->SealUndoNode();
+	return S_OK;
+}
+
+HRESULT CIsoMap::SetUndoMemoryBudget(	__in const size_t budgetBytes,
+										__in const char *spillPath )
+{
+	return this->undoSpill.SetBudget( budgetBytes, spillPath );
+}
+
+HRESULT CIsoMap::ApplyUndoNode(	__inout IsomUndoNode *undoNode )
+{
+	VERIFYARG( undoNode );
+	VERIFYMEMBER( this->isomMatchingData );
+
+	if (this->activeJob)
+		return E_PENDING;
+
+	return undoNode->Apply( this->isomMatchingData, &this->changedArea );
+}
+
+IsomUndoNode::IsomUndoNode( void )
+	:	UndoNodeBase( UNDO_ISOMCHANGE )
+{
+	this->isoMap		= nullptr;
+	this->spill			= nullptr;
+	this->prevSpillNode	= nullptr;
+	this->nextSpillNode	= nullptr;
+	this->isSpilled		= false;
+	this->spillOffset	= ~0ULL;
+	this->spillWords	= 0;
+	this->spillPackedWords	= 0;
+}
+
+IsomUndoNode::~IsomUndoNode( void )
+{
+	if (this->spill)
+		this->spill->Untrack( this );
+	if (this->isoMap)
+		this->isoMap->DetachUndoNode();
+}
+
+HRESULT IsomUndoNode::Apply(	__inout MapIsomData *isomData,
+								__inout TileRect *changedArea )
+{
+	VERIFYARG( isomData );
+	VERIFYARG( changedArea );
 
-		hr = terrainLayerEditor.SetBaseTileIndex( X * 2 + 0, Y, (destTileGroup + 0) * 16 + destSubTile );
-		hr = terrainLayerEditor.SetBaseTileIndex( X * 2 + 1, Y, (destTileGroup + 1) * 16 + destSubTile );
+	HRESULT hr;
+
+	//	Still being recorded, so the data isn't there yet
+	if (this->isoMap)
+		this->isoMap->SealUndoNode();
+
+	if (this->spill)
+	{
+		hr = this->spill->PageIn( this );
+		RETURNHRSILENT_IF_ERROR( hr );
+	}
+	else if (this->isSpilled)
+	{
+		//	The map is gone, but the spill file is still there for this node
+		hr = this->ReadSpilledData();
+		RETURNHRSILENT_IF_ERROR( hr );
+	}
 
+	if (! this->data && this->spillWords != 0)
+		return E_OUTOFMEMORY;
 
-		//	Find the top row of the set of linked tile group transitions
-		TileCoordinate yPosition = Y;
-		if (yPosition > 0)
+	const WORD *seeker	= this->data.get();
+	const WORD *dataEnd	= seeker + this->spillWords;
+	while (seeker < dataEnd)
+	{
+		if (dataEnd - seeker < 3)
+			return E_FAIL;
+
+		const TileCoordinate runX	= seeker[0];
+		const TileCoordinate runY	= seeker[1];
+		const size_t numRunCells	= seeker[2];
+		if (runY >= isomData->GetHeight() || runX + numRunCells > isomData->GetWidth())
+			return E_FAIL;
+
+		const WORD *masks	= seeker + 3;
+		const WORD *deltas	= masks + (numRunCells + 3) / 4;
+		if (deltas > dataEnd)
+			return E_FAIL;
+
+		MapIsomData::IsomRect *targetRect = isomData->GetIsomRect( runX, runY );
+		for (size_t cellIndex=0;cellIndex<numRunCells;cellIndex++,targetRect++)
 		{
-			//	Cache the previous row's value -> then we only need to grab one row per loop iteration
-			const TerrainData::TileGroupInfo *prvRowTileGroupInfo = tileset->GetTileGroup( this->mapTerrain->GetBaseTileIndex(X * 2, yPosition) );
-			while (yPosition > 0)
+			const size_t cellMask = (masks[cellIndex / 4] >> ((cellIndex % 4) * 4)) & 0x0F;
+			if (cellMask == 0)
+				continue;
+
+			for (size_t valueIndex=0;valueIndex<4;valueIndex++)
 			{
-				//	Swap the previous row to this iteration's current row
-				const TerrainData::TileGroupInfo *curRowTileGroupInfo = prvRowTileGroupInfo;
-				if (! curRowTileGroupInfo || curRowTileGroupInfo->intraGroupMatching[1] == 0)
-					break;
+				if (! (cellMask & (1 << valueIndex)))
+					continue;
+				if (deltas >= dataEnd)
+					return E_FAIL;
 
-				prvRowTileGroupInfo = tileset->GetTileGroup( this->mapTerrain->GetBaseTileIndex(X * 2, yPosition - 1) );
-				if (! prvRowTileGroupInfo || curRowTileGroupInfo->intraGroupMatching[1] != prvRowTileGroupInfo->intraGroupMatching[3])
-					break;
+				targetRect->SetRawIsomValue( valueIndex, targetRect->GetRawIsomValue( valueIndex ) ^ *deltas );
+				++deltas;
+			}
 
-				--yPosition;
+			//	Flag the flipped rect so it gets retiled
+			for (size_t i=0;i<4;i++)
+			{
+				targetRect->SetIsomValueChanged( i );
 			}
 		}
 
-		//	Set subtile of the top row of the cliff stack
-		hr = terrainLayerEditor.SetBaseTileIndex( X * 2 + 0, yPosition, SCEngine::GetTileGroupIndex( this->mapTerrain->GetBaseTileIndex( X * 2 + 0, yPosition ) ) * 16 + destSubTile );
-		hr = terrainLayerEditor.SetBaseTileIndex( X * 2 + 1, yPosition, SCEngine::GetTileGroupIndex( this->mapTerrain->GetBaseTileIndex( X * 2 + 1, yPosition ) ) * 16 + destSubTile );
+		changedArea->left	= (std::min)( changedArea->left,	runX );
+		changedArea->right	= (std::max)( changedArea->right,	static_cast<TileCoordinate>( runX + numRunCells - 1 ) );
+		changedArea->top	= (std::min)( changedArea->top,		runY );
+		changedArea->bottom	= (std::max)( changedArea->bottom,	runY );
 
-		//	And now set terrain + subtiles of the rest of the stack
-		++yPosition;
-		while (yPosition < this->mapTerrain->GetHeight())
+		seeker = deltas;
+	}
+
+	return S_OK;
+}
+
+
+HRESULT IsomUndoNode::ReadSpilledData( void )
+{
+	HRESULT hr;
+	VERIFYMEMBER( this->spillFile );
+
+	std::unique_ptr<WORD[]> data;
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( data, WORD, this->spillWords );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	hr = this->spillFile->Read( this->spillOffset, this->spillPackedWords, data.get(), this->spillWords );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	this->data		= std::move( data );
+	this->isSpilled	= false;
+	return S_OK;
+}
+
+
+IsomUndoSpillFile::IsomUndoSpillFile( void )
+{
+	this->fileSize = 0;
+}
+
+IsomUndoSpillFile::~IsomUndoSpillFile( void )
+{
+	if (this->file.is_open())
+	{
+		this->file.close();
+		::remove( this->path.c_str() );
+	}
+}
+
+HRESULT IsomUndoSpillFile::Open(	__in const std::string &path )
+{
+	if (this->file.is_open())
+		return E_FAIL;
+
+	this->file.open( path.c_str(), std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc );
+	if (! this->file.is_open())
+		return E_FAIL;
+
+	this->path		= path;
+	this->fileSize	= 0;
+	return S_OK;
+}
+
+HRESULT IsomUndoSpillFile::Append(	__in const WORD *data,
+									__in const size_t numWords,
+									__out unsigned __int64 *offset,
+									__out size_t *packedWords )
+{
+	VERIFYARG( offset );
+	VERIFYARG( packedWords );
+
+	Pack( data, numWords, &this->packBuffer );
+
+	this->file.clear();
+	this->file.seekp( static_cast<std::streamoff>( this->fileSize ) );
+	this->file.write( reinterpret_cast<const char *>( this->packBuffer.data() ), this->packBuffer.size() * sizeof(WORD) );
+	if (! this->file)
+		return E_FAIL;
+
+	*offset			= this->fileSize;
+	*packedWords	= this->packBuffer.size();
+	this->fileSize	+= this->packBuffer.size() * sizeof(WORD);
+	return S_OK;
+}
+
+HRESULT IsomUndoSpillFile::Read(	__in const unsigned __int64 offset,
+									__in const size_t packedWords,
+									__out WORD *data,
+									__in const size_t numWords )
+{
+	this->packBuffer.resize( packedWords );
+
+	this->file.clear();
+	this->file.seekg( static_cast<std::streamoff>( offset ) );
+	this->file.read( reinterpret_cast<char *>( this->packBuffer.data() ), packedWords * sizeof(WORD) );
+	if (! this->file)
+		return E_FAIL;
+
+	return Unpack( this->packBuffer.data(), packedWords, data, numWords );
+}
+
+void IsomUndoSpillFile::Pack(	__in const WORD *data,
+								__in const size_t numWords,
+								__out std::vector<WORD> *packed )
+{
+	packed->clear();
+
+	size_t literalHeader = 0;
+	bool literalOpen = false;
+	for (size_t i=0;i<numWords;)
+	{
+		size_t repeatWords = 1;
+		while (i + repeatWords < numWords && repeatWords < MAX_RUN_WORDS && data[i + repeatWords] == data[i])
+			++repeatWords;
+
+		//	Shorter repeats take no less space than leaving them in a literal run
+		if (repeatWords >= 3)
 		{
-			const TerrainData::TileGroupInfo *curRowTileGroupInfo = tileset->GetTileGroup( this->mapTerrain->GetBaseTileIndex(X * 2, yPosition - 1) );
-			if (! curRowTileGroupInfo)
-				break;
-			unsigned __int16 curRowTileGroupMatching = curRowTileGroupInfo->intraGroupMatching[3];
-			const TerrainData::TileGroupInfo *nxtRowTileGroupInfo = tileset->GetTileGroup( this->mapTerrain->GetBaseTileIndex(X * 2, yPosition + 0) );
-			if (! nxtRowTileGroupInfo)
-				break;
-			unsigned __int16 nxtRowTileGroupMatching = nxtRowTileGroupInfo->intraGroupMatching[1];
-			if (curRowTileGroupMatching == 0 || nxtRowTileGroupMatching == 0)
-				break;
+			packed->push_back( static_cast<WORD>( REPEAT_FLAG | repeatWords ) );
+			packed->push_back( data[i] );
+			literalOpen = false;
+			i += repeatWords;
+			continue;
+		}
+
+		if (! literalOpen || (*packed)[literalHeader] == MAX_RUN_WORDS)
+		{
+			literalHeader = packed->size();
+			literalOpen = true;
+			packed->push_back( 0 );
+		}
+		packed->push_back( data[i] );
+		++(*packed)[literalHeader];
+		++i;
+	}
+}
+
+HRESULT IsomUndoSpillFile::Unpack(	__in const WORD *packed,
+									__in const size_t packedWords,
+									__out WORD *data,
+									__in const size_t numWords )
+{
+	const WORD *packedEnd	= packed + packedWords;
+	const WORD *dataEnd		= data + numWords;
+	while (packed < packedEnd)
+	{
+		const size_t runWords = *packed & MAX_RUN_WORDS;
+		const bool isRepeat = (*packed & REPEAT_FLAG) != 0;
+		++packed;
+		if (runWords > static_cast<size_t>( dataEnd - data ))
+			return E_FAIL;
+
+		if (isRepeat)
+		{
+			if (packed >= packedEnd)
+				return E_FAIL;
+			for (size_t i=0;i<runWords;i++)
+				data[i] = *packed;
+			++packed;
+		}
+		else
+		{
+			if (runWords > static_cast<size_t>( packedEnd - packed ))
+				return E_FAIL;
+			::memcpy( data, packed, runWords * sizeof(WORD) );
+			packed += runWords;
+		}
+		data += runWords;
+	}
+
+	return (data == dataEnd) ? S_OK : E_FAIL;
+}
+
+
+IsomUndoSpill::IsomUndoSpill( void )
+{
+	this->residentNodes.first	= nullptr;
+	this->residentNodes.last	= nullptr;
+	this->spilledNodes.first	= nullptr;
+	this->spilledNodes.last		= nullptr;
+	this->residentBytes			= 0;
+	this->budgetBytes			= 0;
+}
+
+IsomUndoSpill::~IsomUndoSpill( void )
+{
+	//	The undo list may outlive the map. Spilled nodes hold on to the spill file, and read their data back
+	//	from it when they are applied, so nothing has to be paged in here.
+	while (this->spilledNodes.first)
+		this->Untrack( this->spilledNodes.first );
+	while (this->residentNodes.first)
+		this->Untrack( this->residentNodes.first );
+}
+
+HRESULT IsomUndoSpill::SetBudget(	__in const size_t budgetBytes,
+									__in const char *spillPath )
+{
+	VERIFYARG( spillPath );
+
+	//	Spilled data can't follow the file to a new place
+	if (this->spillFile && this->spillPath != spillPath)
+		return E_INVALIDARG;
+
+	this->budgetBytes	= budgetBytes;
+	this->spillPath		= spillPath;
+	return this->EnforceBudget();
+}
+
+HRESULT IsomUndoSpill::Track(	__inout IsomUndoNode *undoNode )
+{
+	VERIFYARG( undoNode );
+
+	undoNode->spill		= this;
+	undoNode->isSpilled	= false;
+	Link( &this->residentNodes, undoNode );
+	this->residentBytes += undoNode->spillWords * sizeof(WORD);
+
+	return this->EnforceBudget();
+}
+
+void IsomUndoSpill::Untrack(	__inout IsomUndoNode *undoNode )
+{
+	if (undoNode->isSpilled)
+	{
+		Unlink( &this->spilledNodes, undoNode );
+	}
+	else
+	{
+		Unlink( &this->residentNodes, undoNode );
+		this->residentBytes -= undoNode->spillWords * sizeof(WORD);
+	}
+
+	undoNode->spill = nullptr;
+}
+
+HRESULT IsomUndoSpill::PageIn(	__inout IsomUndoNode *undoNode )
+{
+	HRESULT hr;
+	VERIFYARG( undoNode );
+
+	if (! undoNode->isSpilled)
+	{
+		//	Most recently used now
+		Unlink( &this->residentNodes, undoNode );
+		Link( &this->residentNodes, undoNode );
+		return S_OK;
+	}
+
+	hr = undoNode->ReadSpilledData();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	Unlink( &this->spilledNodes, undoNode );
+	Link( &this->residentNodes, undoNode );
+	this->residentBytes += undoNode->spillWords * sizeof(WORD);
+
+	return this->EnforceBudget();
+}
+
+HRESULT IsomUndoSpill::Spill(	__inout IsomUndoNode *undoNode )
+{
+	HRESULT hr;
+
+	//	Data that was paged back in is still in the file
+	if (! undoNode->spillFile)
+	{
+		if (! this->spillFile)
+		{
+			std::shared_ptr<IsomUndoSpillFile> spillFile( new (std::nothrow) IsomUndoSpillFile );
+			if (! spillFile)
+				return E_OUTOFMEMORY;
+
+			hr = spillFile->Open( this->spillPath );
+			RETURNHRSILENT_IF_ERROR( hr );
 
-			//	Remember these seperately, for failure case.
-			//	Not sure this is really needed
-			SCEngine::TileGroupIndex destTileGroupA = SCEngine::GetTileGroupIndex( this->mapTerrain->GetBaseTileIndex( X * 2 + 0, yPosition ) );
-			SCEngine::TileGroupIndex destTileGroupB = SCEngine::GetTileGroupIndex( this->mapTerrain->GetBaseTileIndex( X * 2 + 1, yPosition ) );
-			if (curRowTileGroupMatching != nxtRowTileGroupMatching)
+			this->spillFile = spillFile;
+		}
+
+		hr = this->spillFile->Append( undoNode->data.get(), undoNode->spillWords, &undoNode->spillOffset, &undoNode->spillPackedWords );
+		RETURNHRSILENT_IF_ERROR( hr );
+
+		undoNode->spillFile = this->spillFile;
+	}
+
+	undoNode->data.reset();
+	Unlink( &this->residentNodes, undoNode );
+	Link( &this->spilledNodes, undoNode );
+	undoNode->isSpilled = true;
+	this->residentBytes -= undoNode->spillWords * sizeof(WORD);
+
+	return S_OK;
+}
+
+HRESULT IsomUndoSpill::EnforceBudget( void )
+{
+	HRESULT hr;
+
+	//	The most recently used node always stays, it is about to be applied or was just recorded
+	while (this->budgetBytes != 0 && this->residentBytes > this->budgetBytes &&
+		   this->residentNodes.first != this->residentNodes.last)
+	{
+		hr = this->Spill( this->residentNodes.first );
+		RETURNHRSILENT_IF_ERROR( hr );
+	}
+
+	return S_OK;
+}
+
+void IsomUndoSpill::Link(	__inout NodeList *nodeList,
+							__inout IsomUndoNode *undoNode )
+{
+	undoNode->prevSpillNode = nodeList->last;
+	undoNode->nextSpillNode = nullptr;
+	if (nodeList->last)
+		nodeList->last->nextSpillNode = undoNode;
+	else
+		nodeList->first = undoNode;
+	nodeList->last = undoNode;
+}
+
+void IsomUndoSpill::Unlink(	__inout NodeList *nodeList,
+							__inout IsomUndoNode *undoNode )
+{
+	if (undoNode->prevSpillNode)
+		undoNode->prevSpillNode->nextSpillNode = undoNode->nextSpillNode;
+	else
+		nodeList->first = undoNode->nextSpillNode;
+
+	if (undoNode->nextSpillNode)
+		undoNode->nextSpillNode->prevSpillNode = undoNode->prevSpillNode;
+	else
+		nodeList->last = undoNode->prevSpillNode;
+
+	undoNode->prevSpillNode = nullptr;
+	undoNode->nextSpillNode = nullptr;
+}
+
+
+template <typename UndoPolicy>
+HRESULT CIsoMap::SetDiamondIsom(	__in const TileCoordinate diamondX,
+									__in const TileCoordinate diamondY,
+									__in const MapIsomData::IsomValue isomVal,
+									__in const UndoPolicy &undo )
+{
+	HRESULT hr;
+	ISOM_COUNT( diamondsChanged );
+
+	for (size_t curDir=0;curDir<4;++curDir)
+	{
+		TileCoordinate tileX = diamondX + diamondXYtoTileXY[curDir * 2 + 0];
+		TileCoordinate tileY = diamondY + diamondXYtoTileXY[curDir * 2 + 1];
+		if (! IsInBounds( tileX, tileY ))
+			continue;
+
+		hr = this->SetTileIsom(tileX, tileY, curDir, isomVal, undo);
+		RETURNHRSILENT_IF_ERROR( hr );
+	}
+
+	return S_OK;
+}
+
+
+template <typename UndoPolicy>
+HRESULT CIsoMap::SetTileIsom(	__in const TileCoordinate tileX,
+								__in const TileCoordinate tileY,
+								__in const size_t dir,
+								__in const MapIsomData::IsomValue isomVal,
+								__in const UndoPolicy &undo )
+{
+	MapIsomData::IsomRect *targetRect = this->isomMatchingData->GetIsomRect( tileX, tileY );
+
+	if (this->previewActive)
+		this->SavePreviewRect( tileX, tileY );
+
+	//	Always null with NoUndo, which takes the copy below out as well
+	IsomUndoCell *undoCell = this->RecordUndoCell( undo, tileX, tileY );
+
+	targetRect->SetIsomValue( dir, isomVal );
+	targetRect->SetIsomValueChanged( dir );
+	targetRect->ClearDirVisited( dir );
+
+	if (undoCell)
+	{
+		undoCell->newRect.SetRawIsomValue(0, targetRect->GetRawIsomValue(0) );
+		undoCell->newRect.SetRawIsomValue(1, targetRect->GetRawIsomValue(1) );
+		undoCell->newRect.SetRawIsomValue(2, targetRect->GetRawIsomValue(2) );
+		undoCell->newRect.SetRawIsomValue(3, targetRect->GetRawIsomValue(3) );
+	}
+
+	this->changedArea.left   = (std::min)(this->changedArea.left,   tileX );
+	this->changedArea.right  = (std::max)(this->changedArea.right,  tileX );
+	this->changedArea.top    = (std::min)(this->changedArea.top,    tileY );
+	this->changedArea.bottom = (std::max)(this->changedArea.bottom, tileY );
+
+	return S_OK;
+}
+
+IsomUndoCell *CIsoMap::RecordUndoCell(	__in const RecordUndo &undo,
+										__in const TileCoordinate tileX,
+										__in const TileCoordinate tileY )
+{
+	if (! this->undoCellTable)
+		return nullptr;
+
+	this->PrepareUndoNode( tileX, tileY, undo.undoID, undo.undoList );
+	return this->GetUndoCell( tileX + tileY * this->isomMatchingData->GetWidth() );
+}
+
+IsomUndoCell *CIsoMap::RecordUndoCell(	__in const JobUndo &undo,
+										__in const TileCoordinate tileX,
+										__in const TileCoordinate tileY )
+{
+	IsomRestoreRect restoreRect;
+	restoreRect.offset		= tileX + tileY * this->isomMatchingData->GetWidth();
+	restoreRect.isomRect	= *this->isomMatchingData->GetIsomRect( tileX, tileY );
+	undo.job->restoreRects.push_back( restoreRect );
+
+	if (! undo.job->undoList)
+		return nullptr;
+	return this->RecordUndoCell( RecordUndo( undo.job->undoID, undo.job->undoList ), tileX, tileY );
+}
+
+template <typename UndoPolicy>
+void CIsoMap::RestoreIsomRect(	__in const IsomRestoreRect &restoreRect,
+								__in const UndoPolicy &undo )
+{
+	const TileCoordinate tileX = static_cast<TileCoordinate>( restoreRect.offset % this->isomMatchingData->GetWidth() );
+	const TileCoordinate tileY = static_cast<TileCoordinate>( restoreRect.offset / this->isomMatchingData->GetWidth() );
+
+	IsomUndoCell *undoCell = this->RecordUndoCell( undo, tileX, tileY );
+
+	MapIsomData::IsomRect *targetRect = this->isomMatchingData->GetIsomRect( tileX, tileY );
+	*targetRect = restoreRect.isomRect;
+	for (size_t i=0;i<4;i++)
+	{
+		targetRect->SetIsomValueChanged( i );
+	}
+
+	if (undoCell)
+	{
+		for (size_t i=0;i<4;i++)
+		{
+			undoCell->newRect.SetRawIsomValue( i, targetRect->GetRawIsomValue( i ) );
+		}
+	}
+}
+
+//	Counter based random number, the same seed and position always give the same value
+static DWORD GetTileRandom(	__in const DWORD seed,
+							__in const TileCoordinate X,
+							__in const TileCoordinate Y )
+{
+	unsigned __int64 z = (static_cast<unsigned __int64>( seed ) << 32) ^ (static_cast<unsigned __int64>( Y & 0xFFFF ) << 16) ^ (X & 0xFFFF);
+	z += 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return static_cast<DWORD>( z ^ (z >> 31) );
+}
+
+void SubtileAliasTable::Build(	__in const TerrainData::TileGroupInfo *tileGroupInfo )
+{
+	//	Every subtile with a megatile gets the same weight. In units where a column holds
+	//	numUsable, each of those subtiles brings 16.
+	DWORD weights[16];
+	DWORD numUsable = 0;
+	for (size_t i=0;i<16;i++)
+	{
+		weights[i] = (tileGroupInfo->tileIDs[i] != 0) ? 16 : 0;
+		numUsable += (weights[i] != 0) ? 1 : 0;
+	}
+
+	if (numUsable == 0)
+	{
+		//	Always subtile 0
+		for (size_t i=0;i<16;i++)
+		{
+			this->threshold[i]	= 0;
+			this->alias[i]		= 0;
+		}
+		return;
+	}
+
+	//	Vose's method, in integers so every machine builds the same table
+	BYTE smallColumns[16];
+	BYTE largeColumns[16];
+	size_t numSmall = 0;
+	size_t numLarge = 0;
+	for (BYTE i=0;i<16;i++)
+	{
+		if (weights[i] < numUsable)
+			smallColumns[numSmall++] = i;
+		else
+			largeColumns[numLarge++] = i;
+	}
+
+	while (numSmall > 0 && numLarge > 0)
+	{
+		const BYTE smallColumn = smallColumns[--numSmall];
+		const BYTE largeColumn = largeColumns[numLarge - 1];
+
+		this->threshold[smallColumn]	= static_cast<DWORD>( (static_cast<unsigned __int64>( weights[smallColumn] ) * THRESHOLD_ONE) / numUsable );
+		this->alias[smallColumn]		= largeColumn;
+
+		weights[largeColumn] -= numUsable - weights[smallColumn];
+		if (weights[largeColumn] < numUsable)
+		{
+			--numLarge;
+			smallColumns[numSmall++] = largeColumn;
+		}
+	}
+
+	while (numLarge > 0)
+	{
+		const BYTE column = largeColumns[--numLarge];
+		this->threshold[column]	= THRESHOLD_ONE;
+		this->alias[column]		= column;
+	}
+	while (numSmall > 0)
+	{
+		const BYTE column = smallColumns[--numSmall];
+		this->threshold[column]	= THRESHOLD_ONE;
+		this->alias[column]		= column;
+	}
+}
+
+HRESULT CIsoMap::PrepareSubtileTables( void )
+{
+	HRESULT hr;
+	VERIFYMEMBER( this->mapTerrain );
+
+	const SI_CTileset *tileset = this->mapTerrain->GetTileset();
+	if (tileset == this->subtileTablesTileset)
+		return S_OK;
+
+	this->numSubtileTables		= 0;
+	this->subtileTablesTileset	= nullptr;
+	if (tileset == nullptr)
+		return S_OK;
+
+	//	Tile groups are numbered without gaps, so count until the tileset runs out
+	static const size_t MAX_TILE_GROUPS = 0x10000 / 16;
+	size_t numTileGroups = 0;
+	while (numTileGroups < MAX_TILE_GROUPS && tileset->GetTileGroup( static_cast<SCEngine::TileIndex>( numTileGroups * 16 ) ) != nullptr)
+		++numTileGroups;
+
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( subtileTables, SubtileAliasTable, numTileGroups );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	for (size_t i=0;i<numTileGroups;i++)
+		this->subtileTables[i].Build( tileset->GetTileGroup( static_cast<SCEngine::TileIndex>( i * 16 ) ) );
+
+	this->numSubtileTables		= numTileGroups;
+	this->subtileTablesTileset	= tileset;
+	return S_OK;
+}
+
+unsigned __int16 CIsoMap::SampleSubtile(	__in const unsigned __int16 tileGroup,
+											__in const TerrainData::TileGroupInfo *tileGroupInfo,
+											__in const TileCoordinate X,
+											__in const TileCoordinate Y ) const
+{
+	if (! this->terrainSeeded)
+	{
+		unsigned __int16 destSubTile = 0;
+		this->mapTerrain->GetTileset()->GetRandomSubtile( tileGroup, &destSubTile );
+		return destSubTile % 16;
+	}
+
+	const DWORD randomValue = GetTileRandom( this->terrainSeed, X, Y );
+	if (tileGroup < this->numSubtileTables)
+		return this->subtileTables[tileGroup].Sample( randomValue );
+
+	//	Groups the tables don't cover get the same result, just not precomputed
+	SubtileAliasTable subtileTable;
+	subtileTable.Build( tileGroupInfo );
+	return subtileTable.Sample( randomValue );
+}
+
+void CIsoMap::PlaceFinalTerrain(	__in const TileCoordinate X,
+									__in const TileCoordinate Y,
+									__inout std::vector<TileDelta> *tileDeltas )
+{
+	if (X >= this->isomMatchingData->GetWidth() || Y >= this->isomMatchingData->GetHeight())
+		return;
+
+	//	If the tables can't be built, SampleSubtile builds the table of each group on the stack,
+	//	as it does for the groups the tables don't cover
+	this->PrepareSubtileTables();
+
+	unsigned __int16 destSubTile;
+	if (this->PlaceFinalTile( X, Y, this->GetTileHash( X, Y ), tileDeltas, &destSubTile ))
+	{
+		this->ResolveCliffStack( X, Y, destSubTile, tileDeltas );
+	}
+}
+
+bool CIsoMap::PlaceFinalTile(	__in const TileCoordinate X,
+								__in const TileCoordinate Y,
+								__in const DWORD tileHash,
+								__inout std::vector<TileDelta> *tileDeltas,
+								__out unsigned __int16 *destSubTile )
+{
+	if (X + 1 >= this->isomMatchingData->GetWidth() || Y + 1 >= this->isomMatchingData->GetHeight())
+		return false;
+
+	const SI_CTileset *tileset = this->mapTerrain->GetTileset();
+	ISOM_COUNT( tilesFinalized );
+
+	const std::vector<CMegaGroupNode>	*potentialTileList = tileset->GetHashArray(tileHash);
+	
+	if (potentialTileList == NULL)
+	{
+		this->StageTileIndex( tileDeltas, X * 2 + 0, Y, 0 );
+		this->StageTileIndex( tileDeltas, X * 2 + 1, Y, 0 );
+		this->UpdateCliffStackCache( X, Y, Y );
+		return false;
+	}
+
+	unsigned __int16 destTileGroup = (*potentialTileList)[0].groupIndex;
+	const TerrainData::TileGroupInfo *destTileGroupInfo = (*potentialTileList)[0].tileGroupRef;
+
+	//	Use the tile row above the current one to determine the exact type of tile group to use
+	//	Random guess: this facilitates cliff stacking
+	if (Y != 0)
+	{
+		const TerrainData::TileGroupInfo *prvRowTileGroupInfo = tileset->GetTileGroup( this->GetFinalTileIndex(X * 2, Y - 1) );
+		if (prvRowTileGroupInfo)
+		{
+			unsigned __int16 prvRowTileGroupMatching = prvRowTileGroupInfo->intraGroupMatching[3];
+			for (size_t i=0;i<potentialTileList->size();++i)
+			{
+				if ((*potentialTileList)[i].tileGroupRef->intraGroupMatching[1] != prvRowTileGroupMatching)
+					continue;
+
+				destTileGroup = (*potentialTileList)[i].groupIndex;
+				destTileGroupInfo = (*potentialTileList)[i].tileGroupRef;
+				break;
+			}
+		}
+	}
+
+	//	Set the actual tile values
+	*destSubTile = this->SampleSubtile( destTileGroup, destTileGroupInfo, X, Y );
+
+	this->StageTileIndex( tileDeltas, X * 2 + 0, Y, (destTileGroup + 0) * 16 + *destSubTile );
+	this->StageTileIndex( tileDeltas, X * 2 + 1, Y, (destTileGroup + 1) * 16 + *destSubTile );
+
+	this->UpdateCliffStackCache( X, Y, Y );
+	return true;
+}
+
+void CIsoMap::ResolveCliffStack(	__in const TileCoordinate X,
+									__in const TileCoordinate Y,
+									__in const unsigned __int16 destSubTile,
+									__inout std::vector<TileDelta> *tileDeltas )
+{
+	const SI_CTileset *tileset = this->mapTerrain->GetTileset();
+
+	//	Find the top row of the set of linked tile group transitions
+	TileCoordinate yPosition = this->GetCliffStackTop( X, Y );
+
+	//	Set subtile of the top row of the cliff stack
+	this->StageTileIndex( tileDeltas, X * 2 + 0, yPosition, SCEngine::GetTileGroupIndex( this->GetFinalTileIndex( X * 2 + 0, yPosition ) ) * 16 + destSubTile );
+	this->StageTileIndex( tileDeltas, X * 2 + 1, yPosition, SCEngine::GetTileGroupIndex( this->GetFinalTileIndex( X * 2 + 1, yPosition ) ) * 16 + destSubTile );
+
+	//	And now set terrain + subtiles of the rest of the stack
+	++yPosition;
+	while (yPosition < this->mapTerrain->GetHeight())
+	{
+		const TerrainData::TileGroupInfo *curRowTileGroupInfo = tileset->GetTileGroup( this->GetFinalTileIndex(X * 2, yPosition - 1) );
+		if (! curRowTileGroupInfo)
+			break;
+		unsigned __int16 curRowTileGroupMatching = curRowTileGroupInfo->intraGroupMatching[3];
+		const TerrainData::TileGroupInfo *nxtRowTileGroupInfo = tileset->GetTileGroup( this->GetFinalTileIndex(X * 2, yPosition + 0) );
+		if (! nxtRowTileGroupInfo)
+			break;
+		unsigned __int16 nxtRowTileGroupMatching = nxtRowTileGroupInfo->intraGroupMatching[1];
+		if (curRowTileGroupMatching == 0 || nxtRowTileGroupMatching == 0)
+			break;
+
+		//	Remember these seperately, for failure case.
+		//	Not sure this is really needed
+		SCEngine::TileGroupIndex destTileGroupA = SCEngine::GetTileGroupIndex( this->GetFinalTileIndex( X * 2 + 0, yPosition ) );
+		SCEngine::TileGroupIndex destTileGroupB = SCEngine::GetTileGroupIndex( this->GetFinalTileIndex( X * 2 + 1, yPosition ) );
+		if (curRowTileGroupMatching != nxtRowTileGroupMatching)
+		{
+			//	Not through the hash cache, other columns may be finalized at the same time
+			DWORD TileHash = this->ComputeTileHash( this->isomMatchingData->GetIsomRect( X, yPosition ) );
+			const std::vector<CMegaGroupNode>	*potentialTileList = tileset->GetHashArray(TileHash);
+
+			if (potentialTileList != NULL)
+			{
+				for (size_t i=0;i<potentialTileList->size();++i)
+				{
+					if ((*potentialTileList)[i].tileGroupRef->intraGroupMatching[1] != curRowTileGroupMatching)
+						continue;
+
+					destTileGroupA = ((*potentialTileList)[i].groupIndex + 0);
+					destTileGroupB = destTileGroupA + 1;
+					break;
+				}
+			}
+		}
+
+		this->StageTileIndex( tileDeltas, X * 2 + 0, yPosition, destTileGroupA * 16 + destSubTile );
+		this->StageTileIndex( tileDeltas, X * 2 + 1, yPosition, destTileGroupB * 16 + destSubTile );
+		++yPosition;
+		ISOM_COUNT( cliffStackSteps );
+	}
+
+	//	Rows above Y only had their subtiles changed, so the links only moved from Y + 1 onwards
+	if (Y + 1 < yPosition)
+		this->UpdateCliffStackCache( X, Y + 1, yPosition - 1 );
+}
+
+
+bool CIsoMap::IsLinkedToRowAbove(	__in const TileCoordinate X,
+									__in const TileCoordinate tileY )
+{
+	if (tileY == 0)
+		return false;
+
+	const SI_CTileset *tileset = this->mapTerrain->GetTileset();
+
+	const TerrainData::TileGroupInfo *curRowTileGroupInfo = tileset->GetTileGroup( this->GetFinalTileIndex(X * 2, tileY) );
+	if (! curRowTileGroupInfo || curRowTileGroupInfo->intraGroupMatching[1] == 0)
+		return false;
+
+	const TerrainData::TileGroupInfo *prvRowTileGroupInfo = tileset->GetTileGroup( this->GetFinalTileIndex(X * 2, tileY - 1) );
+	if (! prvRowTileGroupInfo || curRowTileGroupInfo->intraGroupMatching[1] != prvRowTileGroupInfo->intraGroupMatching[3])
+		return false;
+
+	return true;
+}
+
+size_t CIsoMap::GetNumCliffStackRows( void ) const
+{
+	return (std::min)( this->isomMatchingData->GetHeight() - 1, static_cast<size_t>( this->mapTerrain->GetHeight() ) );
+}
+
+size_t CIsoMap::RefreshCliffStackCache(	__in const TileRect &area )
+{
+	//	The tiles may have been changed outside of the isom functions since the last finalization,
+	//	so the entries of the area are rebuilt from the tiles. The top row of the area may get linked
+	//	to the row above it, so that starts at the top of the stack the row above is part of.
+	const size_t numRows = this->GetNumCliffStackRows();
+	if (area.top >= numRows)
+		return 0;
+
+	size_t numEntries = 0;
+	const TileCoordinate firstRow	= (area.top != 0) ? area.top - 1 : 0;
+	const TileCoordinate lastRow	= (std::min)( area.bottom, static_cast<TileCoordinate>( numRows - 1 ) );
+	for (TileCoordinate X=area.left;X<=area.right && X + 1<this->isomMatchingData->GetWidth();++X)
+	{
+		TileCoordinate stackTop = firstRow;
+		while (this->IsLinkedToRowAbove( X, stackTop ))
+			--stackTop;
+
+		for (TileCoordinate tileY=stackTop;tileY<=lastRow;++tileY)
+		{
+			const size_t cacheIndex = X + tileY * this->isomMatchingData->GetWidth();
+			if (this->previewActive)
+				this->previewCliffStackTops.push_back( std::make_pair( cacheIndex, this->cliffStackTop[cacheIndex] ) );
+
+			if (tileY != stackTop && this->IsLinkedToRowAbove( X, tileY ))
+				this->cliffStackTop[cacheIndex] = this->cliffStackTop[cacheIndex - this->isomMatchingData->GetWidth()];
+			else
+				this->cliffStackTop[cacheIndex] = static_cast<WORD>( tileY );
+			++numEntries;
+		}
+	}
+
+	return numEntries;
+}
+
+void CIsoMap::UpdateCliffStackCache(	__in const TileCoordinate X,
+										__in const TileCoordinate firstChangedRow,
+										__in const TileCoordinate lastChangedRow )
+{
+	//	Links change for the changed rows and the row below them. Further down,
+	//	a row only needs fixing up while the top it inherits differs from the cached one.
+	const size_t numRows = this->GetNumCliffStackRows();
+	for (TileCoordinate tileY=firstChangedRow;tileY<numRows;++tileY)
+	{
+		const size_t cacheIndex = X + tileY * this->isomMatchingData->GetWidth();
+		WORD newStackTop = static_cast<WORD>( tileY );
+		if (this->IsLinkedToRowAbove( X, tileY ))
+			newStackTop = this->cliffStackTop[cacheIndex - this->isomMatchingData->GetWidth()];
+
+		if (tileY > lastChangedRow + 1 && newStackTop == this->cliffStackTop[cacheIndex])
+			break;
+
+		if (this->previewActive)
+			this->previewCliffStackTops.push_back( std::make_pair( cacheIndex, this->cliffStackTop[cacheIndex] ) );
+		this->cliffStackTop[cacheIndex] = newStackTop;
+		ISOM_COUNT( cliffStackSteps );
+	}
+}
+
+TileCoordinate CIsoMap::GetCliffStackTop(	__in const TileCoordinate X,
+											__in const TileCoordinate tileY ) const
+{
+	return this->cliffStackTop[X + tileY * this->isomMatchingData->GetWidth()];
+}
+
+
+HRESULT CIsoMap::ResetChangedArea( void )
+{
+	this->changedArea.left   = this->isomMatchingData->GetWidth();
+	this->changedArea.right  = 0;
+	this->changedArea.top    = this->isomMatchingData->GetHeight();
+	this->changedArea.bottom = 0;
+
+	return S_OK;
+}
+
+HRESULT CIsoMap::PlaceTerrain(	__in const TileCoordinate diamondX,
+								__in const TileCoordinate diamondY,
+								__in SCEngine::TileGroupID tileGroupID,
+								__in const size_t brushExtent,
+								__in const DWORD undoID,
+								__in CScmdraftUndo *undoList )
+{
+	HRESULT hr;
+
+	if (this->activeJob)
+		return E_PENDING;
+
+	if (! this->isomMatchingData)
+		return false;
+	ISOM_STATISTICS_SCOPE( this, IsomStatistics::OP_PLACETERRAIN );
+
+	unsigned __int16 newTerrainIsomVal = this->isomMatchingData->GetIsomVal( tileGroupID );
+	if (newTerrainIsomVal == 0)
+		return E_INVALIDARG;
+
+	//	XXX: This shouldn't be required ...
+	hr = this->ResetChangedArea();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	hr = this->InternalPlaceIsom( diamondX, diamondY, brushExtent, newTerrainIsomVal, undoID, undoList );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	return S_OK;
+}
+
+HRESULT CIsoMap::PreviewTerrain(	__in const TileCoordinate diamondX,
+									__in const TileCoordinate diamondY,
+									__in SCEngine::TileGroupID tileGroupID,
+									__in const size_t brushExtent,
+									__out std::vector<TileDelta> *tileDeltas )
+{
+	HRESULT hr;
+	VERIFYARG( tileDeltas );
+	VERIFYMEMBER( this->isomMatchingData );
+	VERIFYMEMBER( this->mapTerrain );
+
+	if (this->activeJob)
+		return E_PENDING;
+
+	tileDeltas->clear();
+
+	unsigned __int16 newTerrainIsomVal = this->isomMatchingData->GetIsomVal( tileGroupID );
+	if (newTerrainIsomVal == 0)
+		return E_INVALIDARG;
+
+	//	Keep the deltas of the last real finalization and any area still waiting for one around
+	std::vector<TileDelta> committedTileDeltas;
+	committedTileDeltas.swap( this->tileDeltas );
+	const TileRect pendingArea = this->changedArea;
+
+	hr = this->ResetChangedArea();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	//	Everything changed from here on is put back by RestorePreview.
+	//	Without an undo list no undo nodes are created.
+	this->previewActive = true;
+
+	hr = this->InternalPlaceIsom( diamondX, diamondY, brushExtent, newTerrainIsomVal, NoUndo() );
+	if (SUCCEEDED( hr ))
+	{
+		//	Finalization clears the changed flags of the whole area, not only of the rects set above
+		for (TileCoordinate y=this->changedArea.top;y<=this->changedArea.bottom;++y)
+		{
+			for (TileCoordinate x=this->changedArea.left;x<=this->changedArea.right;++x)
+				this->SavePreviewRect( x, y );
+		}
+
+		hr = this->StageFinalTerrain( this->changedArea );
+	}
+	if (SUCCEEDED( hr ))
+	{
+		this->SortTileDeltas();
+		tileDeltas->swap( this->tileDeltas );
+	}
+
+	this->RestorePreview();
+	this->tileDeltas.swap( committedTileDeltas );
+	this->changedArea = pendingArea;
+	return hr;
+}
+
+HRESULT CIsoMap::VerifyPreviewTerrain(	__in const TileCoordinate diamondX,
+										__in const TileCoordinate diamondY,
+										__in SCEngine::TileGroupID tileGroupID,
+										__in const size_t brushExtent )
+{
+	HRESULT hr;
+	VERIFYMEMBER( this->isomMatchingData );
+
+	const size_t isomWidth	= this->isomMatchingData->GetWidth();
+	const size_t isomHeight	= this->isomMatchingData->GetHeight();
+
+	std::unique_ptr<MapIsomData::IsomRect[]>	savedRects;
+	std::unique_ptr<WORD[]>						savedCliffStackTops;
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( savedRects, MapIsomData::IsomRect, isomWidth * isomHeight );
+	RETURNHRSILENT_IF_ERROR( hr );
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( savedCliffStackTops, WORD, isomWidth * isomHeight );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	for (TileCoordinate y=0;y<isomHeight;++y)
+		::memcpy( &savedRects[y * isomWidth], this->isomMatchingData->GetIsomRect( 0, y ), isomWidth * sizeof(MapIsomData::IsomRect) );
+	::memcpy( savedCliffStackTops.get(), this->cliffStackTop.get(), isomWidth * isomHeight * sizeof(WORD) );
+
+	std::vector<TileDelta> tileDeltas;
+	hr = this->PreviewTerrain( diamondX, diamondY, tileGroupID, brushExtent, &tileDeltas );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	for (TileCoordinate y=0;y<isomHeight;++y)
+	{
+		if (::memcmp( &savedRects[y * isomWidth], this->isomMatchingData->GetIsomRect( 0, y ), isomWidth * sizeof(MapIsomData::IsomRect) ) != 0)
+			return E_FAIL;
+	}
+	if (::memcmp( savedCliffStackTops.get(), this->cliffStackTop.get(), isomWidth * isomHeight * sizeof(WORD) ) != 0)
+		return E_FAIL;
+
+	return S_OK;
+}
+
+void CIsoMap::SavePreviewRect(	__in const TileCoordinate x,
+								__in const TileCoordinate y )
+{
+	PreviewRect previewRect;
+	previewRect.offset		= x + y * this->isomMatchingData->GetWidth();
+	previewRect.isomRect	= *this->isomMatchingData->GetIsomRect( x, y );
+	this->previewRects.push_back( previewRect );
+}
+
+void CIsoMap::RestorePreview( void )
+{
+	//	Newest first, so rects and cache entries that changed more than once end up at their oldest value
+	for (size_t i=this->previewRects.size();i>0;i--)
+	{
+		const PreviewRect &previewRect = this->previewRects[i - 1];
+		this->isomMatchingData->GetIsomRect( previewRect.offset % this->isomMatchingData->GetWidth(),
+											 previewRect.offset / this->isomMatchingData->GetWidth() )[0] = previewRect.isomRect;
+	}
+
+	for (size_t i=this->previewCliffStackTops.size();i>0;i--)
+		this->cliffStackTop[this->previewCliffStackTops[i - 1].first] = this->previewCliffStackTops[i - 1].second;
+
+	this->previewRects.clear();
+	this->previewCliffStackTops.clear();
+	this->isomStack.clear();
+
+	this->UnstageTiles();
+
+	this->previewActive = false;
+}
+
+HRESULT CIsoMap::FinalizeTerrain(	__in TerrainLayer &terrainLayerEditor )
+{
+	HRESULT hr;
+
+	if (this->activeJob)
+		return E_PENDING;
+
+	ISOM_STATISTICS_SCOPE( this, IsomStatistics::OP_FINALIZETERRAIN );
+
+	hr = this->InternalFinalizeTerrain( this->changedArea, terrainLayerEditor );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	hr = this->ResetChangedArea();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	return S_OK;
+}
+
+
+HRESULT CIsoMap::FillTerrain(	__in const TileCoordinate diamondX,
+								__in const TileCoordinate diamondY,
+								__in SCEngine::TileGroupID tileGroupID,
+								__in const DWORD undoID,
+								__in CScmdraftUndo *undoList )
+{
+	VERIFYMEMBER( this->isomMatchingData );
+
+	if (this->activeJob)
+		return E_PENDING;
+
+	ISOM_STATISTICS_SCOPE( this, IsomStatistics::OP_PLACETERRAIN );
+
+	if ( (diamondX + diamondY) % 2 == 1 || ! IsInBounds( diamondX, diamondY ))
+		return E_INVALIDARG;
+
+	unsigned __int16 newTerrainIsomVal = this->isomMatchingData->GetIsomVal( tileGroupID );
+	if (newTerrainIsomVal == 0)
+		return E_INVALIDARG;
+
+	if (newTerrainIsomVal * 13UL >= this->isomMatchingData->isomDataTableLength ||
+		this->isomMatchingData->isomDataTbl[newTerrainIsomVal * 13 + 0] == 0x00)
+	{
+		return E_INVALIDARG;
+	}
+
+	const MapIsomData::IsomValue regionIsomVal = this->isomMatchingData->GetIsomValue( diamondX, diamondY );
+	if (regionIsomVal == newTerrainIsomVal)
+		return S_FALSE;
+
+	if (undoList)
+		return this->FillIsomRegion( diamondX, diamondY, regionIsomVal, newTerrainIsomVal, RecordUndo( undoID, undoList ) );
+	return this->FillIsomRegion( diamondX, diamondY, regionIsomVal, newTerrainIsomVal, NoUndo() );
+}
+
+template <typename UndoPolicy>
+HRESULT CIsoMap::FillIsomRegion(	__in const TileCoordinate diamondX,
+									__in const TileCoordinate diamondY,
+									__in const MapIsomData::IsomValue regionIsomVal,
+									__in const MapIsomData::IsomValue isomVal,
+									__in const UndoPolicy &undo )
+{
+	HRESULT hr;
+
+	hr = this->ResetChangedArea();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	//	Scanline fill along u. Filled diamonds no longer hold the region's value,
+	//	so the value check doubles as the visited check.
+	struct FillSpan
+	{
+		long	uLeft;
+		long	uRight;
+		long	v;
+	};
+	std::vector<FillSpan>	filledSpans;
+	std::vector<POINT>		seedStack;
+
+	POINT seedPt;
+	seedPt.x = (static_cast<long>(diamondX) + static_cast<long>(diamondY)) / 2;
+	seedPt.y = (static_cast<long>(diamondY) - static_cast<long>(diamondX)) / 2;
+	seedStack.push_back( seedPt );
+
+	while (! seedStack.empty())
+	{
+		POINT curPt = seedStack.back(); seedStack.pop_back();
+		if (! this->IsInFillRegion( curPt.x, curPt.y, regionIsomVal ))
+			continue;
+
+		FillSpan span;
+		span.v		= curPt.y;
+		span.uLeft	= curPt.x;
+		span.uRight	= curPt.x;
+		while (this->IsInFillRegion( span.uLeft - 1, span.v, regionIsomVal ))
+			--span.uLeft;
+		while (this->IsInFillRegion( span.uRight + 1, span.v, regionIsomVal ))
+			++span.uRight;
+
+		for (long u=span.uLeft;u<=span.uRight;++u)
+		{
+			hr = this->SetDiamondIsom( u - span.v, u + span.v, isomVal, undo );
+			RETURNHRSILENT_IF_ERROR( hr );
+		}
+		filledSpans.push_back( span );
+
+		//	Seed every run of region diamonds on the neighboring lines
+		for (long v=span.v - 1;v<=span.v + 1;v += 2)
+		{
+			bool inRun = false;
+			for (long u=span.uLeft;u<=span.uRight;++u)
+			{
+				bool inRegion = this->IsInFillRegion( u, v, regionIsomVal );
+				if (inRegion && ! inRun)
+				{
+					POINT runPt;
+					runPt.x = u;
+					runPt.y = v;
+					seedStack.push_back( runPt );
+				}
+				inRun = inRegion;
+			}
+		}
+	}
+
+	//	Now that the whole region is set (and flagged as changed), only diamonds
+	//	outside of the region pass the filter in EnqueueTileUpdate.
+	for (size_t k=0;k<filledSpans.size();++k)
+	{
+		const FillSpan &span = filledSpans[k];
+		for (long u=span.uLeft;u<=span.uRight;++u)
+		{
+			//	Neighbors along the span are only outside the region at its ends
+			for (size_t i=0;i<4;i++)
+			{
+				bool alongSpan = (diamondNeighborOffsets[i * 2 + 0] == diamondNeighborOffsets[i * 2 + 1]);
+				if (alongSpan && u != span.uLeft && u != span.uRight)
+					continue;
+
+				TileCoordinate neighborDiamondX = (u - span.v) + diamondNeighborOffsets[i * 2 + 0];
+				TileCoordinate neighborDiamondY = (u + span.v) + diamondNeighborOffsets[i * 2 + 1];
+
+				hr = this->EnqueueTileUpdate( neighborDiamondX, neighborDiamondY );
+				RETURNHRSILENT_IF_ERROR( hr );
+			}
+		}
+	}
+
+	hr = this->PropagateIsomChanges( undo );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	return S_OK;
+}
+
+HRESULT CIsoMap::ReplaceTerrain(	__in SCEngine::TileGroupID fromTileGroupID,
+									__in SCEngine::TileGroupID toTileGroupID,
+									__in const DWORD undoID,
+									__in CScmdraftUndo *undoList )
+{
+	HRESULT hr;
+	VERIFYMEMBER( this->isomMatchingData );
+
+	if (this->activeJob)
+		return E_PENDING;
+
+	ISOM_STATISTICS_SCOPE( this, IsomStatistics::OP_PLACETERRAIN );
+
+	unsigned __int16 fromTerrainIsomVal	= this->isomMatchingData->GetIsomVal( fromTileGroupID );
+	unsigned __int16 toTerrainIsomVal	= this->isomMatchingData->GetIsomVal( toTileGroupID );
+	if (fromTerrainIsomVal == 0 || toTerrainIsomVal == 0)
+		return E_INVALIDARG;
+
+	if (toTerrainIsomVal * 13UL >= this->isomMatchingData->isomDataTableLength ||
+		this->isomMatchingData->isomDataTbl[toTerrainIsomVal * 13 + 0] == 0x00)
+	{
+		return E_INVALIDARG;
+	}
+
+	if (fromTerrainIsomVal == toTerrainIsomVal)
+		return S_FALSE;
+
+	std::vector<POINT> replacedDiamonds;
+	hr = this->isomMatchingData->FindDiamondsWithValue( fromTerrainIsomVal, &replacedDiamonds );
+	RETURNHRSILENT_IF_ERROR( hr );
+	if (replacedDiamonds.empty())
+		return S_FALSE;
+
+	if (undoList)
+		return this->ReplaceIsomDiamonds( replacedDiamonds, toTerrainIsomVal, RecordUndo( undoID, undoList ) );
+	return this->ReplaceIsomDiamonds( replacedDiamonds, toTerrainIsomVal, NoUndo() );
+}
+
+template <typename UndoPolicy>
+HRESULT CIsoMap::ReplaceIsomDiamonds(	__in const std::vector<POINT> &diamonds,
+										__in const MapIsomData::IsomValue isomVal,
+										__in const UndoPolicy &undo )
+{
+	HRESULT hr;
+
+	hr = this->ResetChangedArea();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	for (size_t k=0;k<diamonds.size();++k)
+	{
+		hr = this->SetDiamondIsom( diamonds[k].x, diamonds[k].y, isomVal, undo );
+		RETURNHRSILENT_IF_ERROR( hr );
+	}
+
+	//	Replaced diamonds are flagged as changed, so this only enqueues the borders of the replaced regions
+	for (size_t k=0;k<diamonds.size();++k)
+	{
+		for (size_t i=0;i<4;i++)
+		{
+			TileCoordinate neighborDiamondX = diamonds[k].x + diamondNeighborOffsets[i * 2 + 0];
+			TileCoordinate neighborDiamondY = diamonds[k].y + diamondNeighborOffsets[i * 2 + 1];
+
+			hr = this->EnqueueTileUpdate( neighborDiamondX, neighborDiamondY );
+			RETURNHRSILENT_IF_ERROR( hr );
+		}
+	}
+
+	hr = this->PropagateIsomChanges( undo );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	return S_OK;
+}
+
+HRESULT CIsoMap::PasteRegion(	__in MapIsomData *source,
+								__in const TileRect &srcRect,
+								__in const TileCoordinate dstX,
+								__in const TileCoordinate dstY,
+								__in const DWORD undoID,
+								__in CScmdraftUndo *undoList )
+{
+	HRESULT hr;
+	VERIFYARG( source );
+	VERIFYMEMBER( this->isomMatchingData );
+
+	if (this->activeJob)
+		return E_PENDING;
+
+	ISOM_STATISTICS_SCOPE( this, IsomStatistics::OP_PASTEREGION );
+
+	if (srcRect.right < srcRect.left || srcRect.bottom < srcRect.top ||
+		srcRect.right >= source->GetWidth() || srcRect.bottom >= source->GetHeight())
+	{
+		return E_INVALIDARG;
+	}
+	if (! IsInBounds( dstX, dstY ))
+		return E_INVALIDARG;
+
+	//	Diamonds only sit on even x + y, so the offset has to keep that parity
+	if ( (srcRect.left + srcRect.top + dstX + dstY) % 2 == 1)
+		return E_INVALIDARG;
+
+	TileRect pasteArea;
+	pasteArea.left   = dstX;
+	pasteArea.top    = dstY;
+	pasteArea.right  = dstX + static_cast<TileCoordinate>( (std::min)( static_cast<size_t>( srcRect.right  - srcRect.left + 1 ), this->isomMatchingData->GetWidth()  - dstX ) );
+	pasteArea.bottom = dstY + static_cast<TileCoordinate>( (std::min)( static_cast<size_t>( srcRect.bottom - srcRect.top + 1 ),  this->isomMatchingData->GetHeight() - dstY ) );
+	const size_t pasteWidth = pasteArea.right - pasteArea.left;
+
+	hr = this->ResetChangedArea();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	TileRect snapshotArea;
+	snapshotArea.left   = pasteArea.left;
+	snapshotArea.top    = pasteArea.top;
+	snapshotArea.right  = pasteArea.right - 1;
+	snapshotArea.bottom = pasteArea.bottom - 1;
+
+	std::unique_ptr<MapIsomData::IsomRect[]> snapshot;
+	if (undoList)
+	{
+		hr = this->BeginUndoSnapshot( &snapshotArea, 1, &snapshot );
+		RETURNHRSILENT_IF_ERROR( hr );
+	}
+
+	//	Walk the rows against the direction of the move, in case the source is this map
+	const size_t numRows = pasteArea.bottom - pasteArea.top;
+	const bool bottomUp = (source == this->isomMatchingData && dstY > srcRect.top);
+	for (size_t row=0;row<numRows;++row)
+	{
+		const size_t rowOffset = bottomUp ? numRows - 1 - row : row;
+		MapIsomData::IsomRect *destRow = this->isomMatchingData->GetIsomRect( pasteArea.left, pasteArea.top + rowOffset );
+		::memmove( destRow, source->GetIsomRect( srcRect.left, srcRect.top + rowOffset ), pasteWidth * sizeof(MapIsomData::IsomRect) );
+
+		//	Flagging every pasted rect gets it retiled, and keeps the matching from stepping into the paste
+		for (size_t x=0;x<pasteWidth;++x)
+		{
+			destRow[x].ClearChanged();
+			for (size_t i=0;i<4;i++)
+			{
+				destRow[x].SetIsomValueChanged( i );
+			}
+		}
+	}
+
+	if (undoList)
+	{
+		hr = this->CommitUndoSnapshot( &snapshotArea, 1, snapshot.get(), undoID, undoList );
+		RETURNHRSILENT_IF_ERROR( hr );
+	}
+
+	this->changedArea.left   = (std::min)(this->changedArea.left,   snapshotArea.left );
+	this->changedArea.right  = (std::max)(this->changedArea.right,  snapshotArea.right );
+	this->changedArea.top    = (std::min)(this->changedArea.top,    snapshotArea.top );
+	this->changedArea.bottom = (std::max)(this->changedArea.bottom, snapshotArea.bottom );
+
+	if (undoList)
+		hr = this->EnqueueAreaSeam( pasteArea, true, RecordUndo( undoID, undoList ) );
+	else
+		hr = this->EnqueueAreaSeam( pasteArea, true, NoUndo() );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	hr = this->PropagateIsomChanges( undoID, undoList );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	return S_OK;
+}
+
+bool CIsoMap::IsInFillRegion(	__in const long u,
+								__in const long v,
+								__in const MapIsomData::IsomValue regionIsomVal )
+{
+	TileCoordinate diamondX = u - v;
+	TileCoordinate diamondY = u + v;
+	if (! IsInBounds( diamondX, diamondY ))
+		return false;
+
+	return this->isomMatchingData->GetIsomValue( diamondX, diamondY ) == regionIsomVal;
+}
+
+HRESULT CIsoMap::RebuildTerrain(	__in TerrainLayer &terrainLayerEditor )
+{
+	HRESULT hr;
+	VERIFYMEMBER( this->isomMatchingData );
+	VERIFYMEMBER( this->mapTerrain );
+
+	if (this->activeJob)
+		return E_PENDING;
+
+	ISOM_STATISTICS_SCOPE( this, IsomStatistics::OP_FINALIZETERRAIN );
+
+	const SI_CTileset *tileset = this->mapTerrain->GetTileset();
+	VERIFYMEMBER( tileset );
+
+	hr = this->PrepareSubtileTables();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	this->BeginTileDeltas();
+
+	//	The isom map extends past the tile map by one row and column
+	if (this->isomMatchingData->GetWidth() < 2 || this->isomMatchingData->GetHeight() < 2)
+		return S_OK;
+	const size_t numColumns	= this->isomMatchingData->GetWidth() - 1;
+	const size_t numRows	= (std::min)( this->isomMatchingData->GetHeight() - 1, static_cast<size_t>( this->mapTerrain->GetHeight() ) );
+
+	static const WORD NO_TILE_GROUP = 0xFFFF;
+
+	std::vector<WORD>	tileGroups( numColumns * numRows, NO_TILE_GROUP );
+	std::vector<BYTE>	subtiles( numColumns * numRows, 0 );
+
+	//	Per column state of the sweep: the group of the row above, and the cliff stack that row belongs to
+	std::vector<const TerrainData::TileGroupInfo*>	prvRowTileGroupInfo( numColumns, nullptr );
+	std::vector<TileCoordinate>						stackTop( numColumns, 0 );
+
+	std::vector<DWORD>	rowHashes( numColumns );
+
+	for (TileCoordinate Y=0;Y<numRows;++Y)
+	{
+		this->MakeRowHashes( this->isomMatchingData->GetIsomRect( 0, Y ), numColumns, rowHashes.data() );
+
+		for (TileCoordinate X=0;X<numColumns;++X)
+		{
+			ISOM_COUNT( tilesFinalized );
+
+			const TerrainData::TileGroupInfo *curRowTileGroupInfo = nullptr;
+
+			const std::vector<CMegaGroupNode>	*potentialTileList = tileset->GetHashArray(rowHashes[X]);
+			if (potentialTileList != NULL)
+			{
+				unsigned __int16 destTileGroup = (*potentialTileList)[0].groupIndex;
+				curRowTileGroupInfo = (*potentialTileList)[0].tileGroupRef;
+
+				//	The row above is already final, so the stacking match only needs to be done once
+				if (prvRowTileGroupInfo[X])
+				{
+					unsigned __int16 prvRowTileGroupMatching = prvRowTileGroupInfo[X]->intraGroupMatching[3];
+					for (size_t i=0;i<potentialTileList->size();++i)
+					{
+						if ((*potentialTileList)[i].tileGroupRef->intraGroupMatching[1] != prvRowTileGroupMatching)
+							continue;
+
+						destTileGroup = (*potentialTileList)[i].groupIndex;
+						curRowTileGroupInfo = (*potentialTileList)[i].tileGroupRef;
+						break;
+					}
+				}
+
+				tileGroups[X + Y * numColumns]	= destTileGroup;
+				subtiles[X + Y * numColumns]	= static_cast<BYTE>( this->SampleSubtile( destTileGroup, curRowTileGroupInfo, X, Y ) );
+			}
+
+			//	Extend the cliff stack of the row above, or close it off and start a new one.
+			//	A whole stack shares the subtile of its bottom row, just like the last tile placed
+			//	in a stack determines the subtiles in PlaceFinalTerrain.
+			bool linkedToPrvRow =	Y != 0 && curRowTileGroupInfo && prvRowTileGroupInfo[X] &&
+									curRowTileGroupInfo->intraGroupMatching[1] != 0 &&
+									curRowTileGroupInfo->intraGroupMatching[1] == prvRowTileGroupInfo[X]->intraGroupMatching[3];
+			if (linkedToPrvRow)
+			{
+				ISOM_COUNT( cliffStackSteps );
+			}
+			else
+			{
+				for (TileCoordinate yPosition=stackTop[X];yPosition + 1<Y;++yPosition)
+					subtiles[X + yPosition * numColumns] = subtiles[X + (Y - 1) * numColumns];
+				stackTop[X] = Y;
+			}
+
+			prvRowTileGroupInfo[X] = curRowTileGroupInfo;
+		}
+	}
+
+	//	Close off the stacks that run to the bottom of the map
+	for (TileCoordinate X=0;X<numColumns;++X)
+	{
+		for (TileCoordinate yPosition=stackTop[X];yPosition + 1<numRows;++yPosition)
+			subtiles[X + yPosition * numColumns] = subtiles[X + (numRows - 1) * numColumns];
+	}
+
+	//	Write out the tiles in row order
+	for (TileCoordinate Y=0;Y<numRows;++Y)
+	{
+		for (TileCoordinate X=0;X<numColumns;++X)
+		{
+			WORD destTileGroup	= tileGroups[X + Y * numColumns];
+			WORD destSubTile	= subtiles[X + Y * numColumns];
+			if (destTileGroup == NO_TILE_GROUP)
+			{
+				this->StageTileIndex( &this->tileDeltas, X * 2 + 0, Y, 0 );
+				this->StageTileIndex( &this->tileDeltas, X * 2 + 1, Y, 0 );
+				continue;
+			}
+
+			this->StageTileIndex( &this->tileDeltas, X * 2 + 0, Y, (destTileGroup + 0) * 16 + destSubTile );
+			this->StageTileIndex( &this->tileDeltas, X * 2 + 1, Y, (destTileGroup + 1) * 16 + destSubTile );
+		}
+	}
+
+	hr = this->CommitTileDeltas( terrainLayerEditor );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	//	Everything is up to date now
+	for (TileCoordinate yPosition=0;yPosition<this->isomMatchingData->GetHeight();++yPosition)
+	{
+		for (TileCoordinate xPosition=0;xPosition<this->isomMatchingData->GetWidth();xPosition++)
+		{
+			this->isomMatchingData->GetIsomRect( xPosition, yPosition )->ClearChanged();
+		}
+	}
+
+	hr = this->ResetChangedArea();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	return S_OK;
+}
+
+HRESULT CIsoMap::BeginPlaceTerrain(	__in const TileCoordinate diamondX,
+									__in const TileCoordinate diamondY,
+									__in SCEngine::TileGroupID tileGroupID,
+									__in const size_t brushExtent,
+									__in const DWORD undoID,
+									__in CScmdraftUndo *undoList,
+									__out IsomTerrainJob *job )
+{
+	HRESULT hr;
+	VERIFYMEMBER( this->isomMatchingData );
+	VERIFYARG( job );
+
+	if (this->activeJob)
+		return E_PENDING;
+
+	if ( (diamondX + diamondY) % 2 == 1)
+		return E_INVALIDARG;
+
+	unsigned __int16 newTerrainIsomVal = this->isomMatchingData->GetIsomVal( tileGroupID );
+	if (newTerrainIsomVal == 0)
+		return E_INVALIDARG;
+
+	if (newTerrainIsomVal * 13UL >= this->isomMatchingData->isomDataTableLength ||
+		this->isomMatchingData->isomDataTbl[newTerrainIsomVal * 13 + 0] == 0x00)
+	{
+		return E_INVALIDARG;
+	}
+
+	hr = this->ResetChangedArea();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	job->Release();
+	job->isoMap		= this;
+	job->phase		= IsomTerrainJob::JOB_PROPAGATE;
+	job->undoID		= undoID;
+	job->undoList	= undoList;
+	this->activeJob	= job;
+
+	//	Stamping is cheap, the matching is what gets split up
+	hr = this->StampIsomSquare( diamondX, diamondY, brushExtent, newTerrainIsomVal, false, JobUndo( job ) );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	hr = this->EnqueueSquareBorder( diamondX, diamondY, brushExtent );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	job->isomStack.clear();
+	job->isomStack.swap( this->isomStack );
+	job->dirtyArea	= this->changedArea;
+	job->cursorX	= 0;
+	job->cursorY	= 0;
+
+	hr = this->ResetChangedArea();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	return S_OK;
+}
+
+HRESULT CIsoMap::BeginFinalizeTerrain(	__out IsomTerrainJob *job )
+{
+	HRESULT hr;
+	VERIFYMEMBER( this->isomMatchingData );
+	VERIFYARG( job );
+
+	if (this->activeJob)
+		return E_PENDING;
+
+	job->Release();
+	job->isoMap		= this;
+	job->phase		= IsomTerrainJob::JOB_REFRESH;
+	job->undoID		= 0;
+	job->undoList	= nullptr;
+	this->activeJob	= job;
+	job->isomStack.clear();
+	job->dirtyArea	= this->changedArea;
+	job->cursorX	= this->changedArea.left;
+	job->cursorY	= this->changedArea.top;
+
+	hr = this->ResetChangedArea();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	return S_OK;
+}
+
+
+IsomTerrainJob::IsomTerrainJob( void )
+{
+	this->isoMap	= nullptr;
+	this->phase		= JOB_IDLE;
+	this->undoID	= 0;
+	this->undoList	= nullptr;
+	this->cursorX	= 0;
+	this->cursorY	= 0;
+
+	this->dirtyArea.left = this->dirtyArea.top = 1;
+	this->dirtyArea.right = this->dirtyArea.bottom = 0;
+}
+
+IsomTerrainJob::~IsomTerrainJob( void )
+{
+	this->Release();
+}
+
+void IsomTerrainJob::Release( void )
+{
+	if (this->isoMap && this->isoMap->activeJob == this)
+		this->isoMap->activeJob = nullptr;
+
+	std::vector<IsomRestoreRect>().swap( this->restoreRects );
+}
+
+static bool IsJobBudgetSpent(	__in const size_t numSteps,
+								__in const size_t maxSteps,
+								__in const std::chrono::steady_clock::time_point &deadline,
+								__in const DWORD maxMilliseconds )
+{
+	if (maxSteps != 0 && numSteps >= maxSteps)
+		return true;
+
+	//	Reading the clock costs more than a step, so only check it every few steps
+	if (maxMilliseconds != 0 && (numSteps & 0x0F) == 0x0F && std::chrono::steady_clock::now() >= deadline)
+		return true;
+
+	return false;
+}
+
+HRESULT IsomTerrainJob::Advance(	__in TerrainLayer &terrainLayerEditor,
+									__in const size_t maxSteps,
+									__in const DWORD maxMilliseconds )
+{
+	HRESULT hr;
+	VERIFYMEMBER( this->isoMap );
+
+	if (this->phase == JOB_COMPLETE)
+		return S_OK;
+	if (this->phase == JOB_IDLE)
+		return E_FAIL;
+
+	ISOM_STATISTICS_SCOPE( this->isoMap, (this->phase == JOB_PROPAGATE) ? IsomStatistics::OP_PLACETERRAIN : IsomStatistics::OP_FINALIZETERRAIN );
+
+	const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds( maxMilliseconds );
+	size_t numSteps = 0;
+
+	if (this->phase == JOB_PROPAGATE)
+	{
+		//	Hand the map our queue and changed area while matching, so SearchForMatch works on them directly
+		this->isoMap->isomStack.swap( this->isomStack );
+		std::swap( this->isoMap->changedArea, this->dirtyArea );
+
+		while (! IsJobBudgetSpent( numSteps, maxSteps, deadline, maxMilliseconds ))
+		{
+			if (! this->isoMap->ProcessNextIsomNode( JobUndo( this ) ))
+				break;
+			++numSteps;
+		}
+
+		this->isoMap->isomStack.swap( this->isomStack );
+		std::swap( this->isoMap->changedArea, this->dirtyArea );
+
+		if (! this->isomStack.empty())
+			return S_FALSE;
+
+		this->phase		= JOB_REFRESH;
+		this->cursorX	= this->dirtyArea.left;
+		this->cursorY	= this->dirtyArea.top;
+	}
+
+	if (this->phase == JOB_REFRESH)
+	{
+		//	Once for the whole dirty area, the finalization keeps the entries up to date from then on.
+		//	Every cache entry rebuilt counts as a step, and a column is long enough to be worth a clock read.
+		while (this->cursorX <= this->dirtyArea.right)
+		{
+			if (maxSteps != 0 && numSteps >= maxSteps)
+				return S_FALSE;
+			if (maxMilliseconds != 0 && std::chrono::steady_clock::now() >= deadline)
+				return S_FALSE;
+
+			TileRect columnArea = this->dirtyArea;
+			columnArea.left		= this->cursorX;
+			columnArea.right	= this->cursorX;
+			numSteps += this->isoMap->RefreshCliffStackCache( columnArea );
+			++this->cursorX;
+		}
+
+		this->phase		= JOB_FINALIZE;
+		this->cursorX	= this->dirtyArea.left;
+	}
+
+	//	The tiles of each slice are written in one batch
+	this->isoMap->BeginTileDeltas();
+	while (this->cursorY <= this->dirtyArea.bottom && ! IsJobBudgetSpent( numSteps, maxSteps, deadline, maxMilliseconds ))
+	{
+		this->isoMap->FinalizeIsomRect( this->cursorX, this->cursorY, &this->isoMap->tileDeltas );
+		++numSteps;
+
+		++this->cursorX;
+		if (this->cursorX > this->dirtyArea.right)
+		{
+			this->cursorX = this->dirtyArea.left;
+			++this->cursorY;
+		}
+	}
+
+	hr = this->isoMap->CommitTileDeltas( terrainLayerEditor );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	if (this->cursorY <= this->dirtyArea.bottom)
+		return S_FALSE;
+
+	this->phase = JOB_COMPLETE;
+	this->Release();
+	return S_OK;
+}
+
+HRESULT IsomTerrainJob::Cancel(	__in TerrainLayer &terrainLayerEditor )
+{
+	HRESULT hr;
+	VERIFYMEMBER( this->isoMap );
+
+	if (this->phase == JOB_IDLE || this->phase == JOB_COMPLETE)
+		return E_FAIL;
+
+	this->isomStack.clear();
+
+	//	In reverse, so a rect changed several times ends up with the value from before the first change
+	for (size_t i=this->restoreRects.size();i>0;i--)
+	{
+		if (this->undoList)
+			this->isoMap->RestoreIsomRect( this->restoreRects[i - 1], RecordUndo( this->undoID, this->undoList ) );
+		else
+			this->isoMap->RestoreIsomRect( this->restoreRects[i - 1], NoUndo() );
+	}
+
+	//	Everything the job touched lies within the dirty area. Retiling it also
+	//	resets the visited flags left over by the matching.
+	hr = this->isoMap->InternalFinalizeTerrain( this->dirtyArea, terrainLayerEditor );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	this->phase = JOB_COMPLETE;
+	this->Release();
+	return S_OK;
+}
+
+
+HRESULT CIsoMap::PlaceTerrainBrush(	__in const TileCoordinate diamondX,
+									__in const TileCoordinate diamondY,
+									__in SCEngine::TileGroupID tileGroupID,
+									__in const IsomBrush &brush,
+									__in const DWORD undoID,
+									__in CScmdraftUndo *undoList )
+{
+	VERIFYMEMBER( this->isomMatchingData );
+
+	if (this->activeJob)
+		return E_PENDING;
+
+	ISOM_STATISTICS_SCOPE( this, IsomStatistics::OP_PLACETERRAIN );
+
+	if ( (diamondX + diamondY) % 2 == 1)
+		return E_INVALIDARG;
+
+	unsigned __int16 newTerrainIsomVal = this->isomMatchingData->GetIsomVal( tileGroupID );
+	if (newTerrainIsomVal == 0)
+		return E_INVALIDARG;
+
+	if (newTerrainIsomVal * 13UL >= this->isomMatchingData->isomDataTableLength ||
+		this->isomMatchingData->isomDataTbl[newTerrainIsomVal * 13 + 0] == 0x00)
+	{
+		return E_INVALIDARG;
+	}
+
+	if (undoList)
+		return this->StampIsomBrush( diamondX, diamondY, brush, newTerrainIsomVal, RecordUndo( undoID, undoList ) );
+	return this->StampIsomBrush( diamondX, diamondY, brush, newTerrainIsomVal, NoUndo() );
+}
+
+template <typename UndoPolicy>
+HRESULT CIsoMap::StampIsomBrush(	__in const TileCoordinate diamondX,
+									__in const TileCoordinate diamondY,
+									__in const IsomBrush &brush,
+									__in const MapIsomData::IsomValue isomVal,
+									__in const UndoPolicy &undo )
+{
+	HRESULT hr;
+
+	hr = this->ResetChangedArea();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	for (size_t i=0;i<brush.diamondOffsets.size();++i)
+	{
+		TileCoordinate curDiamondX = diamondX + brush.diamondOffsets[i].x;
+		TileCoordinate curDiamondY = diamondY + brush.diamondOffsets[i].y;
+		if (! IsInBounds(curDiamondX, curDiamondY))
+			continue;
+
+		hr = this->SetDiamondIsom( curDiamondX, curDiamondY, isomVal, undo );
+		RETURNHRSILENT_IF_ERROR( hr );
+	}
+
+	for (size_t i=0;i<brush.boundaryOffsets.size();++i)
+	{
+		hr = this->EnqueueTileUpdate( diamondX + brush.boundaryOffsets[i].x, diamondY + brush.boundaryOffsets[i].y );
+		RETURNHRSILENT_IF_ERROR( hr );
+	}
+
+	hr = this->PropagateIsomChanges( undo );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	return S_OK;
+}
+
+
+HRESULT CIsoMap::PlaceTerrainStroke(	__in const POINT *strokePoints,
+										__in const size_t numStrokePoints,
+										__in SCEngine::TileGroupID tileGroupID,
+										__in const size_t brushExtent,
+										__in const DWORD undoID,
+										__in CScmdraftUndo *undoList )
+{
+	VERIFYMEMBER( this->isomMatchingData );
+	VERIFYARG( strokePoints );
+
+	if (this->activeJob)
+		return E_PENDING;
+
+	if (numStrokePoints == 0 || brushExtent == 0)
+		return E_INVALIDARG;
+	ISOM_STATISTICS_SCOPE( this, IsomStatistics::OP_PLACETERRAIN );
+
+	unsigned __int16 newTerrainIsomVal = this->isomMatchingData->GetIsomVal( tileGroupID );
+	if (newTerrainIsomVal == 0)
+		return E_INVALIDARG;
+
+	if (newTerrainIsomVal * 13UL >= this->isomMatchingData->isomDataTableLength ||
+		this->isomMatchingData->isomDataTbl[newTerrainIsomVal * 13 + 0] == 0x00)
+	{
+		return E_INVALIDARG;
+	}
+
+	for (size_t i=0;i<numStrokePoints;++i)
+	{
+		if ((strokePoints[i].x + strokePoints[i].y) % 2 != 0)
+			return E_INVALIDARG;
+	}
+
+	//	Work out every stamp position first.
+	//	The brush is a square in the rotated (u, v) space, where u = (x + y) / 2 and v = (y - x) / 2,
+	//	so consecutive stamps are kept at most one brush extent apart in that space to avoid gaps.
+	std::vector<POINT> stampPositions;
+	stampPositions.push_back( strokePoints[0] );
+	for (size_t i=1;i<numStrokePoints;++i)
+	{
+		const POINT &fromPt = strokePoints[i - 1];
+		const POINT &toPt   = strokePoints[i];
+
+		long deltaU = ((toPt.x + toPt.y) - (fromPt.x + fromPt.y)) / 2;
+		long deltaV = ((toPt.y - toPt.x) - (fromPt.y - fromPt.x)) / 2;
+		long numSteps = (std::abs(deltaU) + std::abs(deltaV) + static_cast<long>(brushExtent) - 1) / static_cast<long>(brushExtent);
+
+		for (long step=1;step<=numSteps;++step)
+		{
+			long stepU = (fromPt.x + fromPt.y) / 2 + deltaU * step / numSteps;
+			long stepV = (fromPt.y - fromPt.x) / 2 + deltaV * step / numSteps;
+
+			POINT stampPt;
+			stampPt.x = stepU - stepV;
+			stampPt.y = stepU + stepV;
+			stampPositions.push_back( stampPt );
+		}
+	}
+
+	if (undoList)
+		return this->StampIsomStroke( stampPositions, brushExtent, newTerrainIsomVal, RecordUndo( undoID, undoList ) );
+	return this->StampIsomStroke( stampPositions, brushExtent, newTerrainIsomVal, NoUndo() );
+}
+
+template <typename UndoPolicy>
+HRESULT CIsoMap::StampIsomStroke(	__in const std::vector<POINT> &stampPositions,
+									__in const size_t brushExtent,
+									__in const MapIsomData::IsomValue isomVal,
+									__in const UndoPolicy &undo )
+{
+	HRESULT hr;
+
+	hr = this->ResetChangedArea();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	//	Stamp the union of all the squares before queueing anything,
+	//	so that only diamonds outside of the union get enqueued.
+	for (size_t i=0;i<stampPositions.size();++i)
+	{
+		hr = this->StampIsomSquare( stampPositions[i].x, stampPositions[i].y, brushExtent, isomVal, true, undo );
+		RETURNHRSILENT_IF_ERROR( hr );
+	}
+
+	//	Stamped diamonds are flagged as changed, so this only enqueues the outer boundary of the union
+	for (size_t i=0;i<stampPositions.size();++i)
+	{
+		hr = this->EnqueueSquareBorder( stampPositions[i].x, stampPositions[i].y, brushExtent );
+		RETURNHRSILENT_IF_ERROR( hr );
+	}
+
+	hr = this->PropagateIsomChanges( undo );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	return S_OK;
+}
+
+
+static void GetBrushRange(	__in const size_t brushExtent,
+							__out int *sizeStart,
+							__out int *sizeEnd )
+{
+	*sizeStart	=	-static_cast<int>(brushExtent) / 2;
+	*sizeEnd	=	*sizeStart + static_cast<int>(brushExtent);
+ 	if (brushExtent % 2 == 0)
+	{
+		++(*sizeStart);
+		++(*sizeEnd);
+	}
+}
+
+
+IsomBrush::IsomBrush( void )
+{
+}
+
+HRESULT IsomBrush::CreateSquare(	__in const size_t brushExtent )
+{
+	if (brushExtent == 0)
+		return E_INVALIDARG;
+
+	std::vector<BYTE> mask( brushExtent * brushExtent, 1 );
+	return this->CreateFromMask( mask.data(), brushExtent, brushExtent );
+}
+
+HRESULT IsomBrush::CreateEllipse(	__in const size_t radiusA,
+									__in const size_t radiusB )
+{
+	const size_t maskWidth	= radiusA * 2 + 1;
+	const size_t maskHeight	= radiusB * 2 + 1;
+
+	//	Compare in integers: a^2 * rb^2 + b^2 * ra^2 <= ra^2 * rb^2, with a half step of slack
+	//	so that the tips of the axes are included
+	const unsigned __int64 radiusASquared = (radiusA * 2 + 1) * (radiusA * 2 + 1);
+	const unsigned __int64 radiusBSquared = (radiusB * 2 + 1) * (radiusB * 2 + 1);
+
+	std::vector<BYTE> mask( maskWidth * maskHeight, 0 );
+	for (size_t b=0;b<maskHeight;++b)
+	{
+		for (size_t a=0;a<maskWidth;++a)
+		{
+			const __int64 offsetA = (static_cast<__int64>(a) - static_cast<__int64>(radiusA)) * 2;
+			const __int64 offsetB = (static_cast<__int64>(b) - static_cast<__int64>(radiusB)) * 2;
+			if (offsetA * offsetA * radiusBSquared + offsetB * offsetB * radiusASquared <= radiusASquared * radiusBSquared)
+				mask[a + b * maskWidth] = 1;
+		}
+	}
+
+	return this->CreateFromMask( mask.data(), maskWidth, maskHeight );
+}
+
+HRESULT IsomBrush::CreateFromMask(	__in const BYTE *mask,
+									__in const size_t maskWidth,
+									__in const size_t maskHeight )
+{
+	VERIFYARG( mask );
+	if (maskWidth == 0 || maskHeight == 0)
+		return E_INVALIDARG;
+
+	int startA, endA, startB, endB;
+	GetBrushRange( maskWidth,  &startA, &endA );
+	GetBrushRange( maskHeight, &startB, &endB );
+
+	return this->Rasterize( mask, maskWidth, maskHeight, startA, startB );
+}
+
+HRESULT IsomBrush::Rasterize(	__in const BYTE *mask,
+								__in const size_t maskWidth,
+								__in const size_t maskHeight,
+								__in const int startA,
+								__in const int startB )
+{
+	this->diamondOffsets.clear();
+	this->boundaryOffsets.clear();
+
+	//	Pad the mask by one on every side, so the boundary can be marked in the same grid
+	static const BYTE CELL_EMPTY	= 0;
+	static const BYTE CELL_BRUSH	= 1;
+	static const BYTE CELL_BOUNDARY	= 2;
+
+	const size_t gridWidth	= maskWidth + 2;
+	const size_t gridHeight	= maskHeight + 2;
+	std::vector<BYTE> grid( gridWidth * gridHeight, CELL_EMPTY );
+	for (size_t b=0;b<maskHeight;++b)
+	{
+		for (size_t a=0;a<maskWidth;++a)
+		{
+			if (mask[a + b * maskWidth])
+				grid[(a + 1) + (b + 1) * gridWidth] = CELL_BRUSH;
+		}
+	}
+
+	//	Brush axis steps, in the same order as diamondNeighborOffsets
+	static const int brushNeighborOffsets[] = {	-1,  0,
+												 0, -1,
+												+1,  0,
+												 0, +1 };
+
+	//	Same iteration order as the square brush
+	for (size_t a=1;a<=maskWidth;++a)
+	{
+		for (size_t b=1;b<=maskHeight;++b)
+		{
+			if (grid[a + b * gridWidth] != CELL_BRUSH)
+				continue;
+
+			const int brushA = static_cast<int>(a) - 1 + startA;
+			const int brushB = static_cast<int>(b) - 1 + startB;
+
+			POINT diamondOffset;
+			diamondOffset.x = brushA - brushB;
+			diamondOffset.y = brushA + brushB;
+			this->diamondOffsets.push_back( diamondOffset );
+
+			for (size_t i=0;i<4;i++)
+			{
+				const size_t neighborA = a + brushNeighborOffsets[i * 2 + 0];
+				const size_t neighborB = b + brushNeighborOffsets[i * 2 + 1];
+				BYTE &neighborCell = grid[neighborA + neighborB * gridWidth];
+				if (neighborCell != CELL_EMPTY)
+					continue;
+
+				neighborCell = CELL_BOUNDARY;
+
+				POINT boundaryOffset;
+				boundaryOffset.x = diamondOffset.x + diamondNeighborOffsets[i * 2 + 0];
+				boundaryOffset.y = diamondOffset.y + diamondNeighborOffsets[i * 2 + 1];
+				this->boundaryOffsets.push_back( boundaryOffset );
+			}
+		}
+	}
+
+	return S_OK;
+}
+
+
+HRESULT CIsoMap::InternalPlaceIsom(	__in const TileCoordinate tileX,
+									__in const TileCoordinate tileY,
+									__in const size_t brushExtent,
+									__in DWORD isomVal,
+									__in const DWORD undoID,
+									__in CScmdraftUndo *undoList )
+{
+	if (undoList)
+		return this->InternalPlaceIsom( tileX, tileY, brushExtent, isomVal, RecordUndo( undoID, undoList ) );
+	return this->InternalPlaceIsom( tileX, tileY, brushExtent, isomVal, NoUndo() );
+}
+
+template <typename UndoPolicy>
+HRESULT CIsoMap::InternalPlaceIsom(	__in const TileCoordinate tileX,
+									__in const TileCoordinate tileY,
+									__in const size_t brushExtent,
+									__in DWORD isomVal,
+									__in const UndoPolicy &undo )
+
+{
+	HRESULT hr;
+	VERIFYMEMBER( this->isomMatchingData );
+
+	if ( (tileX + tileY) % 2 == 1)
+		return E_INVALIDARG;
+
+	if (isomVal * 13UL >= this->isomMatchingData->isomDataTableLength ||
+		this->isomMatchingData->isomDataTbl[isomVal * 13 + 0] == 0x00)
+	{
+		return false;
+	}
+
+	hr = this->ResetChangedArea();
+
+	hr = this->StampIsomSquare( tileX, tileY, brushExtent, static_cast<MapIsomData::IsomValue>( isomVal ), false, undo );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	hr = this->EnqueueSquareBorder( tileX, tileY, brushExtent );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	hr = this->PropagateIsomChanges( undo );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	return S_OK;
+}
+
+template <typename UndoPolicy>
+HRESULT CIsoMap::StampIsomSquare(	__in const TileCoordinate tileX,
+									__in const TileCoordinate tileY,
+									__in const size_t brushExtent,
+									__in const MapIsomData::IsomValue isomVal,
+									__in const bool skipStampedDiamonds,
+									__in const UndoPolicy &undo )
+{
+	HRESULT hr;
+
+	int SizeStart, SizeEnd;
+	GetBrushRange( brushExtent, &SizeStart, &SizeEnd );
+
+ 	for (int Xmod = SizeStart;Xmod < SizeEnd; Xmod++)
+	{
+		for (int Ymod = SizeStart;Ymod < SizeEnd; Ymod++)
+		{
+			TileCoordinate diamondX = tileX + Xmod - Ymod;
+			TileCoordinate diamondY = tileY + Xmod + Ymod;
+			if (! IsInBounds(diamondX, diamondY))
+				continue;
+
+			//	Overlapping stamps of a stroke don't need to set the same diamond twice. Only a stroke
+			//	skips them: a single stamp sets every diamond, even ones left flagged by an unfinalized change.
+			if (skipStampedDiamonds &&
+				this->isomMatchingData->GetIsomValueChanged( diamondX, diamondY ) &&
+				this->isomMatchingData->GetIsomValue( diamondX, diamondY ) == isomVal)
+			{
+				continue;
+			}
+
+			hr = this->SetDiamondIsom(diamondX, diamondY, isomVal, undo);
+			RETURNHRSILENT_IF_ERROR( hr );
+		}
+	}
+
+	return S_OK;
+}
+
+HRESULT CIsoMap::EnqueueSquareBorder(	__in const TileCoordinate tileX,
+										__in const TileCoordinate tileY,
+										__in const size_t brushExtent )
+{
+	HRESULT hr;
+
+	int SizeStart, SizeEnd;
+	GetBrushRange( brushExtent, &SizeStart, &SizeEnd );
+
+ 	for (int Xmod = SizeStart;Xmod < SizeEnd; Xmod++)
+	{
+		for (int Ymod = SizeStart;Ymod < SizeEnd; Ymod++)
+		{
+			//	Only enqueue tile updates for the outside edge
+			if (Xmod != SizeStart && Ymod != SizeStart && Xmod != SizeEnd - 1 && Ymod != SizeEnd - 1)
+				continue;
+
+			TileCoordinate diamondX = tileX + Xmod - Ymod;
+			TileCoordinate diamondY = tileY + Xmod + Ymod;
+			if (! IsInBounds(diamondX, diamondY))
+				continue;
+
+			for (size_t i=0;i<4;i++)
+			{
+				TileCoordinate neighborDiamondX = diamondX + diamondNeighborOffsets[i * 2 + 0];
+				TileCoordinate neighborDiamondY = diamondY + diamondNeighborOffsets[i * 2 + 1];
+
+				hr = this->EnqueueTileUpdate( neighborDiamondX, neighborDiamondY );
+				RETURNHRSILENT_IF_ERROR( hr );
+			}
+		}
+	}
+
+	return S_OK;
+}
+
+HRESULT CIsoMap::PropagateIsomChanges(	__in const DWORD undoID,
+										__in CScmdraftUndo *undoList )
+{
+	if (undoList)
+		return this->PropagateIsomChanges( RecordUndo( undoID, undoList ) );
+	return this->PropagateIsomChanges( NoUndo() );
+}
+
+template <typename UndoPolicy>
+HRESULT CIsoMap::PropagateIsomChanges(	__in const UndoPolicy &undo )
+{
+	while (this->ProcessNextIsomNode( undo ))
+	{
+	}
+
+	return S_OK;
+}
+
+template <typename UndoPolicy>
+bool CIsoMap::ProcessNextIsomNode(	__in const UndoPolicy &undo )
+{
+	if (this->isomStack.empty())
+		return false;
+
+	const MatchNode curNode = this->isomStack.front(); this->isomStack.pop_front();
+
+	if (this->GetDiamondNeedsUpdate( curNode.position.x, curNode.position.y ))
+	{
+		this->SearchForMatch(curNode.position.x, curNode.position.y, undo);
+	}
+	else
+	{
+		ISOM_COUNT( duplicatesFiltered );
+	}
+
+	return true;
+}
+
+bool CIsoMap::GetDiamondNeedsUpdate(	__in const TileCoordinate diamondX,
+										__in const TileCoordinate diamondY )
+{
+	if (! IsInBounds(diamondX, diamondY) )
+		return false;
+
+	return GetRectNeedsUpdate( this->isomMatchingData->GetIsomRect( diamondX, diamondY ) );
+}
+
+bool CIsoMap::GetRectNeedsUpdate(	__in const MapIsomData::IsomRect *diamondRect )
+{
+	//	Don't add nodes we know won't be needed
+	if (diamondRect->GetChanged())
+		return false;
+	if ((diamondRect->GetRawIsomValue( 0 ) >> 4) == 0)
+		return false;
+
+	return true;
+}
+
+
+HRESULT CIsoMap::EnqueueTileUpdate(	__in const TileCoordinate diamondX,
+									__in const TileCoordinate diamondY )
+{
+	if (! this->GetDiamondNeedsUpdate(diamondX, diamondY) )
+	{
+		ISOM_COUNT( duplicatesFiltered );
+		return S_FALSE;
+	}
+
+	MatchNode newNode;
+	newNode.position.x = diamondX;
+	newNode.position.y = diamondY;
+	this->isomStack.push_back( newNode );
+	ISOM_COUNT( nodesEnqueued );
+
+	return S_OK;
+}
+
+void CIsoMap::EnqueueDiamondNeighbors(	__in const TileCoordinate diamondX,
+										__in const TileCoordinate diamondY )
+{
+	if (! this->isomMatchingData->HasGuardBand())
+	{
+		for (size_t curDir=0;curDir<4;++curDir)
+		{
+			TileCoordinate neighborX = diamondX + diamondNeighborOffsets[curDir * 2 + 0];
+			TileCoordinate neighborY = diamondY + diamondNeighborOffsets[curDir * 2 + 1];
+			this->EnqueueTileUpdate( neighborX, neighborY );
+		}
+		return;
+	}
+
+	//	Sentinels have isom value 0, so they are filtered out like any other empty diamond
+	const MapIsomData::IsomRect *centerRect = this->isomMatchingData->GetIsomRect( diamondX, diamondY );
+	const ptrdiff_t stride = static_cast<ptrdiff_t>( this->isomMatchingData->GetStride() );
+	for (size_t curDir=0;curDir<4;++curDir)
+	{
+		if (! GetRectNeedsUpdate( centerRect + diamondNeighborOffsets[curDir * 2 + 0] + diamondNeighborOffsets[curDir * 2 + 1] * stride ))
+		{
+			ISOM_COUNT( duplicatesFiltered );
+			continue;
+		}
+
+		MatchNode newNode;
+		newNode.position.x = diamondX + diamondNeighborOffsets[curDir * 2 + 0];
+		newNode.position.y = diamondY + diamondNeighborOffsets[curDir * 2 + 1];
+		this->isomStack.push_back( newNode );
+		ISOM_COUNT( nodesEnqueued );
+	}
+}
+
+
+HRESULT CIsoMap::InternalFinalizeTerrain(	__in const TileRect &changedArea,
+											__in TerrainLayer &terrainLayerEditor )
+{
+	HRESULT hr;
+
+	hr = this->StageFinalTerrain( changedArea );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	return this->CommitTileDeltas( terrainLayerEditor );
+}
+
+HRESULT CIsoMap::StageFinalTerrain(	__in const TileRect &changedArea )
+{
+	HRESULT hr;
+
+	this->BeginTileDeltas();
+	if (changedArea.right < changedArea.left || changedArea.bottom < changedArea.top)
+		return S_OK;
+
+	//	Worker threads only read these
+	hr = this->PrepareSubtileTables();
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	const size_t numColumns	= changedArea.right - changedArea.left + 1;
+	const size_t numRows	= changedArea.bottom - changedArea.top + 1;
+
+	//	Wide areas hash whole rows at once, small ones go through the hash cache
+	static const size_t ROW_HASH_MIN_COLUMNS = 16;
+	const bool useRowHashes = (numColumns >= ROW_HASH_MIN_COLUMNS);
+	std::vector<DWORD>	tileHashes( useRowHashes ? numColumns * numRows : 0 );
+	if (useRowHashes)
+	{
+		for (size_t row=0;row<numRows;++row)
+			this->MakeRowHashes( this->isomMatchingData->GetIsomRect( changedArea.left, changedArea.top + row ), numColumns, &tileHashes[row * numColumns] );
+	}
+
+	//	Each isom column only touches its own tile column pair and its own cliff stack cache entries,
+	//	so columns can be finalized independently once the shared caches are filled in.
+	//	The stack cache is refreshed after BeginTileDeltas, so it is never built from staged tiles
+	this->RefreshCliffStackCache( changedArea );
+
+	//	The tileset's random generator is only used from one thread
+	size_t numThreads = 1;
+	if (useRowHashes && this->terrainSeeded && ! this->previewActive)
+		numThreads = this->GetNumFinalizeThreads( numColumns, numRows );
+
+	//	One delta list per thread, merged for the commit
+	std::vector<std::vector<TileDelta>>	workerTileDeltas( numThreads );
+
+	std::atomic<size_t> nextColumn( 0 );
+	auto finalizeColumns = [&]( size_t workerIndex )
+	{
+		for (size_t column=nextColumn++;column<numColumns;column=nextColumn++)
+		{
+			this->FinalizeTerrainColumn(	changedArea.left + column,
+											changedArea.top,
+											changedArea.bottom,
+											useRowHashes ? &tileHashes[column] : nullptr,
+											numColumns,
+											&workerTileDeltas[workerIndex] );
+		}
+	};
+
+	if (numThreads > 1)
+		this->finalizeWorkers.Run( numThreads, finalizeColumns );
+	else
+		finalizeColumns( 0 );
+
+	for (size_t i=0;i<workerTileDeltas.size();++i)
+		this->tileDeltas.insert( this->tileDeltas.end(), workerTileDeltas[i].begin(), workerTileDeltas[i].end() );
+
+	return S_OK;
+}
+
+void CIsoMap::FinalizeTerrainColumn(	__in const TileCoordinate xPosition,
+										__in const TileCoordinate firstRow,
+										__in const TileCoordinate lastRow,
+										__in_opt const DWORD *tileHashes,
+										__in const size_t tileHashStride,
+										__inout std::vector<TileDelta> *tileDeltas )
+{
+	//	Every tile placed in a cliff stack rewrites the whole stack, and the last one placed wins.
+	//	So only the most recent tile of a stack gets its stack resolved,
+	//	once the column leaves that stack or at the end.
+	static const TileCoordinate NO_PENDING_ROW = static_cast<TileCoordinate>( -1 );
+	TileCoordinate		pendingStackRow = NO_PENDING_ROW;
+	unsigned __int16	pendingSubTile = 0;
+
+	for (TileCoordinate yPosition=firstRow;yPosition<=lastRow;++yPosition)
+	{
+		MapIsomData::IsomRect *curRect = this->isomMatchingData->GetIsomRect( xPosition, yPosition );
+		if (curRect->GetEitherLRChanged())
+		{
+			//	The pending stack has to be resolved before this tile is placed, unless this tile could continue it
+			if (pendingStackRow != NO_PENDING_ROW &&
+				this->GetCliffStackTop( xPosition, yPosition - 1 ) != this->GetCliffStackTop( xPosition, pendingStackRow ))
 			{
-				TileHash = GetTileHash(X, yPosition );
-				const std::vector<CMegaGroupNode>	*potentialTileList = tileset->GetHashArray(TileHash);
+				this->ResolveCliffStack( xPosition, pendingStackRow, pendingSubTile, tileDeltas );
+				pendingStackRow = NO_PENDING_ROW;
+			}
 
-				if (potentialTileList != NULL)
-				{
-					for (size_t i=0;i<potentialTileList->size();++i)
-					{
-						if ((*potentialTileList)[i].tileGroupRef->intraGroupMatching[1] != curRowTileGroupMatching)
-							continue;
+			const DWORD tileHash = tileHashes ? tileHashes[(yPosition - firstRow) * tileHashStride] : this->GetTileHash( xPosition, yPosition );
 
-						destTileGroupA = ((*potentialTileList)[i].groupIndex + 0);
-						destTileGroupB = destTileGroupA + 1;
-						break;
-					}
+			unsigned __int16 destSubTile;
+			if (this->PlaceFinalTile( xPosition, yPosition, tileHash, tileDeltas, &destSubTile ))
+			{
+				if (pendingStackRow != NO_PENDING_ROW &&
+					this->GetCliffStackTop( xPosition, yPosition ) != this->GetCliffStackTop( xPosition, pendingStackRow ))
+				{
+					this->ResolveCliffStack( xPosition, pendingStackRow, pendingSubTile, tileDeltas );
 				}
-			}
 
-			hr = terrainLayerEditor.SetBaseTileIndex( X * 2 + 0, yPosition, destTileGroupA * 16 + destSubTile );
-			hr = terrainLayerEditor.SetBaseTileIndex( X * 2 + 1, yPosition, destTileGroupB * 16 + destSubTile );
-			++yPosition;
+				pendingStackRow	= yPosition;
+				pendingSubTile	= destSubTile;
+			}
 		}
-			
-	}
-	else
-	{
-		hr = terrainLayerEditor.SetBaseTileIndex( X * 2 + 0, Y, 0 );
-		hr = terrainLayerEditor.SetBaseTileIndex( X * 2 + 1, Y, 0 );
+
+		curRect->ClearChanged();
 	}
+
+	if (pendingStackRow != NO_PENDING_ROW)
+		this->ResolveCliffStack( xPosition, pendingStackRow, pendingSubTile, tileDeltas );
 }
 
+size_t CIsoMap::GetNumFinalizeThreads(	__in const size_t numColumns,
+										__in const size_t numRows ) const
+{
+#ifdef SI_ISOM_STATISTICS
+	//	The counters are not thread safe
+	return 1;
+#else
+	//	Starting threads only pays off for large areas
+	static const size_t MIN_TILES_PER_THREAD	= 2048;
+	static const size_t MIN_COLUMNS_PER_THREAD	= 4;
+
+	size_t numThreads = this->finalizeThreadLimit;
+	if (numThreads == 0)
+		numThreads = (std::max)( std::thread::hardware_concurrency(), 1U );
+
+	numThreads = (std::min)( numThreads, (numColumns * numRows) / MIN_TILES_PER_THREAD );
+	numThreads = (std::min)( numThreads, numColumns / MIN_COLUMNS_PER_THREAD );
+	return (std::max)( numThreads, static_cast<size_t>( 1 ) );
+#endif
+}
 
-HRESULT CIsoMap::ResetChangedArea( void )
+IsomWorkerPool::IsomWorkerPool( void )
 {
-	this->changedArea.left   = this->isomMatchingData->GetWidth();
-	this->changedArea.right  = 0;
-	this->changedArea.top    = this->isomMatchingData->GetHeight();
-	this->changedArea.bottom = 0;
+	this->work				= nullptr;
+	this->numWorkingThreads	= 0;
+	this->numBusyThreads	= 0;
+	this->batch				= 0;
+	this->shuttingDown		= false;
+}
 
-	return S_OK;
+IsomWorkerPool::~IsomWorkerPool( void )
+{
+	{
+		std::lock_guard<std::mutex> guard( this->lock );
+		this->shuttingDown = true;
+	}
+	this->workReady.notify_all();
+
+	for (size_t i=0;i<this->threads.size();i++)
+		this->threads[i].join();
 }
 
-HRESULT CIsoMap::PlaceTerrain(	__in const TileCoordinate diamondX,
-								__in const TileCoordinate diamondY,
-								__in SCEngine::TileGroupID tileGroupID,
-								__in const size_t brushExtent,
-								__in const DWORD undoID,
-								__in CScmdraftUndo *undoList )
+void IsomWorkerPool::Run(	__in const size_t numWorkers,
+							__in const std::function<void( size_t )> &work )
 {
-	HRESULT hr;
-	if (! this->isomMatchingData)
-		return false;
+	std::unique_lock<std::mutex> guard( this->lock );
 
-	unsigned __int16 newTerrainIsomVal = this->isomMatchingData->GetIsomVal( tileGroupID );
-	if (newTerrainIsomVal == 0)
-		return E_INVALIDARG;
+	//	Whatever work is left when no more threads can be started is done on this one
+	while (this->threads.size() + 1 < numWorkers)
+	{
+		try
+		{
+			this->threads.emplace_back( &IsomWorkerPool::ThreadLoop, this, this->threads.size(), this->batch );
+		}
+		catch (...)
+		{
+			break;
+		}
+	}
 
-	//	XXX: This shouldn't be required ...
-	hr = this->ResetChangedArea();
-	RETURNHRSILENT_IF_ERROR( hr );
+	this->work				= &work;
+	this->numWorkingThreads	= (numWorkers > 0) ? (std::min)( numWorkers - 1, this->threads.size() ) : 0;
+	this->numBusyThreads	= this->numWorkingThreads;
+	++this->batch;
+	guard.unlock();
+	this->workReady.notify_all();
 
-	hr = this->InternalPlaceIsom( diamondX, diamondY, brushExtent, newTerrainIsomVal, undoID, undoList );
-	RETURNHRSILENT_IF_ERROR( hr );
+	work( 0 );
 
-	return S_OK;
+	guard.lock();
+	this->workDone.wait( guard, [this] { return this->numBusyThreads == 0; } );
+	this->work = nullptr;
 }
 
-HRESULT CIsoMap::FinalizeTerrain(	__in TerrainLayer &terrainLayerEditor )
+void IsomWorkerPool::ThreadLoop(	__in const size_t threadIndex,
+									__in DWORD lastBatch )
 {
-	HRESULT hr;
+	std::unique_lock<std::mutex> guard( this->lock );
+	for (;;)
+	{
+		this->workReady.wait( guard, [&] { return this->shuttingDown || this->batch != lastBatch; } );
+		if (this->shuttingDown)
+			return;
 
-	hr = this->InternalFinalizeTerrain( this->changedArea, terrainLayerEditor );
-	RETURNHRSILENT_IF_ERROR( hr );
+		lastBatch = this->batch;
+		if (threadIndex >= this->numWorkingThreads)
+			continue;
 
-	hr = this->ResetChangedArea();
-	RETURNHRSILENT_IF_ERROR( hr );
+		const std::function<void( size_t )> *work = this->work;
+		guard.unlock();
+		(*work)( threadIndex + 1 );
+		guard.lock();
 
-	return S_OK;
+		if (--this->numBusyThreads == 0)
+			this->workDone.notify_one();
+	}
 }
 
+void CIsoMap::SetFinalizeThreadLimit(	__in const size_t maxThreads )
+{
+	this->finalizeThreadLimit = maxThreads;
+}
 
-HRESULT CIsoMap::InternalPlaceIsom(	__in const TileCoordinate tileX,
-									__in const TileCoordinate tileY,
-									__in const size_t brushExtent,
-									__in DWORD isomVal,
-									__in const DWORD undoID,
-									__in CScmdraftUndo *undoList )
-
+HRESULT CIsoMap::VerifyFinalizeThreads(	__in const size_t maxThreads )
 {
 	HRESULT hr;
 	VERIFYMEMBER( this->isomMatchingData );
+	VERIFYMEMBER( this->mapTerrain );
 
-	if ( (tileX + tileY) % 2 == 1)
-		return E_INVALIDARG;
+	if (this->activeJob)
+		return E_PENDING;
 
-	if (isomVal * 13UL >= this->isomMatchingData->isomDataTableLength ||
-		this->isomMatchingData->isomDataTbl[isomVal * 13 + 0] == 0x00)
-	{
-		return false;
-	}
+	//	Without a seed finalizing never leaves the calling thread
+	if (! this->terrainSeeded)
+		return E_FAIL;
 
-	int SizeStart	=	-static_cast<int>(brushExtent) / 2;
-	int SizeEnd		=	SizeStart + brushExtent;
- 	if (brushExtent % 2 == 0)
-	{
-		SizeStart++;
-		SizeEnd++;
-	}
+	//	The isom map extends past the tile map by one row and column
+	if (this->isomMatchingData->GetWidth() < 2 || this->isomMatchingData->GetHeight() < 2)
+		return S_OK;
 
-	hr = this->ResetChangedArea();
+	TileRect mapArea;
+	mapArea.left	= 0;
+	mapArea.top		= 0;
+	mapArea.right	= this->isomMatchingData->GetWidth() - 2;
+	mapArea.bottom	= static_cast<TileCoordinate>( (std::min)( this->isomMatchingData->GetHeight() - 1, static_cast<size_t>( this->mapTerrain->GetHeight() ) ) ) - 1;
+
+	//	Staging clears the flags, so they are put back after each pass
+	const size_t isomWidth	= this->isomMatchingData->GetWidth();
+	const size_t isomHeight	= this->isomMatchingData->GetHeight();
+	std::unique_ptr<MapIsomData::IsomRect[]> savedRects;
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( savedRects, MapIsomData::IsomRect, isomWidth * isomHeight );
+	RETURNHRSILENT_IF_ERROR( hr );
+	for (TileCoordinate y=0;y<isomHeight;++y)
+		::memcpy( &savedRects[y * isomWidth], this->isomMatchingData->GetIsomRect( 0, y ), isomWidth * sizeof(MapIsomData::IsomRect) );
 
- 	for (int Xmod = SizeStart;Xmod < SizeEnd; Xmod++)
+	const size_t tileWidth	= this->mapTerrain->GetWidth();
+	const size_t tileHeight	= this->mapTerrain->GetHeight();
+	std::vector<SCEngine::TileIndex>	singleThreadTiles( tileWidth * tileHeight );
+
+	const size_t threadLimit = this->finalizeThreadLimit;
+	bool tilesMatch = true;
+	for (size_t pass=0;pass<2 && SUCCEEDED( hr );pass++)
 	{
-		for (int Ymod = SizeStart;Ymod < SizeEnd; Ymod++)
+		for (TileCoordinate y=mapArea.top;y<=mapArea.bottom;++y)
 		{
-			TileCoordinate diamondX = tileX + Xmod - Ymod;
-			TileCoordinate diamondY = tileY + Xmod + Ymod;
-			if (! IsInBounds(diamondX, diamondY))
-				continue;
-
-			SetDiamondIsom(diamondX, diamondY, isomVal, undoID, undoList);
-
-			//	Only enqueue tile updates for the outside edge
-			if (Xmod != SizeStart && Ymod != SizeStart && Xmod != SizeEnd - 1 && Ymod != SizeEnd - 1)
-				continue;
-
-			for (size_t i=0;i<4;i++)
+			MapIsomData::IsomRect *row = this->isomMatchingData->GetIsomRect( 0, y );
+			for (TileCoordinate x=mapArea.left;x<=mapArea.right;++x)
 			{
-				TileCoordinate neighborDiamondX = diamondX + diamondNeighborOffsets[i * 2 + 0];
-				TileCoordinate neighborDiamondY = diamondY + diamondNeighborOffsets[i * 2 + 1];
-
-				hr = this->EnqueueTileUpdate( neighborDiamondX, neighborDiamondY );
-				RETURNHRSILENT_IF_ERROR( hr );
+				for (size_t i=0;i<4;i++)
+					row[x].SetIsomValueChanged( i );
 			}
 		}
-	}
 
-//	size_t isomStepCount = isomStack.size();
-//	size_t processedCount = 0;
-//	SIErrorLogger			logger("Isom");
-	while (! isomStack.empty())
-	{
-		const MatchNode curNode = isomStack.front(); isomStack.pop_front();
+		this->finalizeThreadLimit = (pass == 0) ? 1 : maxThreads;
+		hr = this->StageFinalTerrain( mapArea );
 
-		if (this->GetDiamondNeedsUpdate( curNode.position.x, curNode.position.y ))
+		for (TileCoordinate y=0;y<tileHeight && SUCCEEDED( hr );++y)
 		{
-			SearchForMatch(curNode.position.x, curNode.position.y, undoID, undoList);
-//			logger.ReportWarning("Isom Node: [%4d, %4d]", curNode.position.x, curNode.position.y);
+			for (TileCoordinate x=0;x<tileWidth;++x)
+			{
+				if (pass == 0)
+					singleThreadTiles[x + y * tileWidth] = this->GetFinalTileIndex( x, y );
+				else if (singleThreadTiles[x + y * tileWidth] != this->GetFinalTileIndex( x, y ))
+					tilesMatch = false;
+			}
 		}
-//		else
-//		{
-//			logger.ReportInfo("Isom Node: [%4d, %4d]", curNode.position.x, curNode.position.y);
-//		}
-//
-//		++processedCount;
-//		if (processedCount == isomStepCount)
-//		{
-//			isomStepCount = isomStack.size();
-//			processedCount = 0;
-//			logger.ReportInfo("Isom pass completed\r\n");
-//		}
 	}
 
-	return S_OK;
+	this->finalizeThreadLimit = threadLimit;
+	this->BeginTileDeltas();
+	for (TileCoordinate y=0;y<isomHeight;++y)
+		::memcpy( this->isomMatchingData->GetIsomRect( 0, y ), &savedRects[y * isomWidth], isomWidth * sizeof(MapIsomData::IsomRect) );
+
+	RETURNHRSILENT_IF_ERROR( hr );
+	return tilesMatch ? S_OK : E_FAIL;
 }
 
-bool CIsoMap::GetDiamondNeedsUpdate(	__in const TileCoordinate diamondX,
-										__in const TileCoordinate diamondY )
+void CIsoMap::SetTerrainSeed(	__in const DWORD seed )
 {
-	if (! IsInBounds(diamondX, diamondY) )
-		return false;
-
-	//	Don't add nodes we know won't be needed
-	if (this->isomMatchingData->GetIsomValueChanged( diamondX, diamondY ))
-		return false;
-	if (this->isomMatchingData->GetIsomValue( diamondX, diamondY ) == 0)
-		return false;
-
-	return true;
+	this->terrainSeed	= seed;
+	this->terrainSeeded	= true;
 }
 
+void CIsoMap::BeginTileDeltas( void )
+{
+	this->tileDeltas.clear();
+	this->UnstageTiles();
+}
 
-HRESULT CIsoMap::EnqueueTileUpdate(	__in const TileCoordinate diamondX,
-									__in const TileCoordinate diamondY )
+void CIsoMap::UnstageTiles( void )
 {
-	if (! this->GetDiamondNeedsUpdate(diamondX, diamondY) )
-		return S_FALSE;
+	//	Bumping the generation unstages every tile at once. After a wrap, tiles stamped
+	//	with the old generations would look staged again, so those are cleared.
+	++this->stagedTileGeneration;
+	if (this->stagedTileGeneration == 0)
+	{
+		if (this->stagedTileGenerations)
+			::memset( this->stagedTileGenerations.get(), 0, sizeof(DWORD) * this->stagedTilesWidth * this->stagedTilesHeight );
+		this->stagedTileGeneration = 1;
+	}
+}
 
-	MatchNode newNode;
-	newNode.position.x = diamondX;
-	newNode.position.y = diamondY;
-	this->isomStack.push_back( newNode );
+SCEngine::TileIndex CIsoMap::GetFinalTileIndex(	__in const TileCoordinate tileX,
+												__in const TileCoordinate tileY ) const
+{
+	if (tileX < this->stagedTilesWidth && tileY < this->stagedTilesHeight)
+	{
+		const size_t tileOffset = tileX + tileY * this->stagedTilesWidth;
+		if (this->stagedTileGenerations[tileOffset] == this->stagedTileGeneration)
+			return this->stagedTiles[tileOffset];
+	}
 
-	return S_OK;
+	return this->mapTerrain->GetBaseTileIndex( tileX, tileY );
 }
 
+void CIsoMap::StageTileIndex(	__inout std::vector<TileDelta> *tileDeltas,
+								__in const TileCoordinate tileX,
+								__in const TileCoordinate tileY,
+								__in const SCEngine::TileIndex tileIndex )
+{
+	//	Each tile is only staged by the column that owns it, so this needs no locking
+	if (tileX < this->stagedTilesWidth && tileY < this->stagedTilesHeight)
+	{
+		const size_t tileOffset = tileX + tileY * this->stagedTilesWidth;
+		this->stagedTiles[tileOffset]				= tileIndex;
+		this->stagedTileGenerations[tileOffset]	= this->stagedTileGeneration;
+	}
+
+	TileDelta tileDelta;
+	tileDelta.tileX		= static_cast<WORD>( tileX );
+	tileDelta.tileY		= static_cast<WORD>( tileY );
+	tileDelta.tileIndex	= tileIndex;
+	tileDeltas->push_back( tileDelta );
+}
 
-HRESULT CIsoMap::InternalFinalizeTerrain(	__in const TileRect &changedArea,
-											__in TerrainLayer &terrainLayerEditor )
+void CIsoMap::SortTileDeltas( void )
 {
-	HRESULT hr;
-	UNREFERENCED_PARAMETER( hr );
+	//	Row order, and only the last write to each tile
+	std::stable_sort( this->tileDeltas.begin(), this->tileDeltas.end(), []( const TileDelta &a, const TileDelta &b )
+	{
+		return (a.tileY != b.tileY) ? (a.tileY < b.tileY) : (a.tileX < b.tileX);
+	} );
 
-	for (TileCoordinate yPosition=changedArea.top;yPosition<=changedArea.bottom;++yPosition)
+	size_t numTileDeltas = 0;
+	for (size_t i=0;i<this->tileDeltas.size();i++)
 	{
-		for (TileCoordinate xPosition=changedArea.left;xPosition<=changedArea.right;xPosition++)
+		if (i + 1 < this->tileDeltas.size() &&
+			this->tileDeltas[i + 1].tileX == this->tileDeltas[i].tileX &&
+			this->tileDeltas[i + 1].tileY == this->tileDeltas[i].tileY)
 		{
-//			if ((xPosition + yPosition) % 2 != 0)
-//				continue;
-			MapIsomData::IsomRect *curRect = this->isomMatchingData->GetIsomRect( xPosition, yPosition );
-			if (curRect->GetEitherLRChanged())
-			{
-				this->PlaceFinalTerrain( xPosition, yPosition, terrainLayerEditor );
-			}
-
-			curRect->ClearChanged();
+			continue;
 		}
+
+		this->tileDeltas[numTileDeltas++] = this->tileDeltas[i];
+	}
+	this->tileDeltas.resize( numTileDeltas );
+}
+
+HRESULT CIsoMap::CommitTileDeltas(	__in TerrainLayer &terrainLayerEditor )
+{
+	HRESULT hr;
+
+	this->SortTileDeltas();
+	for (size_t i=0;i<this->tileDeltas.size();i++)
+	{
+		hr = terrainLayerEditor.SetBaseTileIndex( this->tileDeltas[i].tileX, this->tileDeltas[i].tileY, this->tileDeltas[i].tileIndex );
+		RETURNHRSILENT_IF_ERROR( hr );
 	}
 
+	//	The layer has them now
+	this->UnstageTiles();
 	return S_OK;
 }
 
+const std::vector<TileDelta>& CIsoMap::GetTileDeltas( void ) const
+{
+	return this->tileDeltas;
+}
+
+void CIsoMap::FinalizeIsomRect(	__in const TileCoordinate xPosition,
+								__in const TileCoordinate yPosition,
+								__inout std::vector<TileDelta> *tileDeltas )
+{
+//	if ((xPosition + yPosition) % 2 != 0)
+//		return;
+	MapIsomData::IsomRect *curRect = this->isomMatchingData->GetIsomRect( xPosition, yPosition );
+	if (curRect->GetEitherLRChanged())
+	{
+		this->PlaceFinalTerrain( xPosition, yPosition, tileDeltas );
+	}
+
+	curRect->ClearChanged();
+}
 
 bool CIsoMap::IsInBounds(	__in const TileCoordinate diamondX,
 							__in const TileCoordinate diamondY )
@@ -894,15 +3693,28 @@ HRESULT CIsoMap::PrepareSearchNode(	__in const TileCoordinate diamondX,
 		matchData->neighborUnkVal[curDir]	=	0x00;
 		matchData->neighborUpdated[curDir]	=	FALSE;
 	}
+	//	With a guard band, neighbors off the map are sentinels that read the same as the skipped ones below
+	const bool guardBand = this->isomMatchingData->HasGuardBand();
+	const MapIsomData::IsomRect *centerRect = this->isomMatchingData->GetIsomRect( diamondX, diamondY );
+	const ptrdiff_t stride = static_cast<ptrdiff_t>( this->isomMatchingData->GetStride() );
 	for (size_t curDir=0;curDir<4;++curDir)
 	{
-		TileCoordinate neighborX = diamondX + diamondNeighborOffsets[curDir * 2 + 0];
-		TileCoordinate neighborY = diamondY + diamondNeighborOffsets[curDir * 2 + 1];
-		if (! IsInBounds( neighborX, neighborY ) )
-			continue;
+		const MapIsomData::IsomRect *neighborRect;
+		if (guardBand)
+		{
+			neighborRect = centerRect + diamondNeighborOffsets[curDir * 2 + 0] + diamondNeighborOffsets[curDir * 2 + 1] * stride;
+		}
+		else
+		{
+			TileCoordinate neighborX = diamondX + diamondNeighborOffsets[curDir * 2 + 0];
+			TileCoordinate neighborY = diamondY + diamondNeighborOffsets[curDir * 2 + 1];
+			if (! IsInBounds( neighborX, neighborY ) )
+				continue;
+			neighborRect = this->isomMatchingData->GetIsomRect( neighborX, neighborY );
+		}
 
-		matchData->neighborIsomVal[curDir]	=	this->isomMatchingData->GetIsomValue( neighborX, neighborY );
-		matchData->neighborUpdated[curDir]	=	this->isomMatchingData->GetIsomValueChanged( neighborX, neighborY ) ? TRUE : FALSE;
+		matchData->neighborIsomVal[curDir]	=	neighborRect->GetRawIsomValue( 0 ) >> 4;
+		matchData->neighborUpdated[curDir]	=	neighborRect->GetChanged() ? TRUE : FALSE;
 
 		//	Isom tile group row is the isom value * 13 term
 		//	Dir 0: => index  9
@@ -974,12 +3786,13 @@ HRESULT CIsoMap::TestIsomValue(	__in const MapIsomData::IsomValue isomVal,
 	return S_OK;
 }
 
+template <typename UndoPolicy>
 HRESULT CIsoMap::SearchForMatch(	__in const TileCoordinate diamondX,
 									__in const TileCoordinate diamondY,
-									__in const DWORD undoID,
-									__in CScmdraftUndo *undoList )
+									__in const UndoPolicy &undo )
 {
 	HRESULT hr;
+	ISOM_COUNT( searchCalls );
 
 	SearchNode diamondMatchData;
 	hr = this->PrepareSearchNode( diamondX, diamondY, &diamondMatchData );
@@ -993,7 +3806,12 @@ HRESULT CIsoMap::SearchForMatch(	__in const TileCoordinate diamondX,
 	//	We reset this flag if surrounding nodes are changed, since it appears that sometimes the same node
 	//	needs to be visited multiply times?
 	if (this->isomMatchingData->GetIsomRect( diamondX, diamondY )->GetDirVisited( 0 ))
+	{
+		ISOM_COUNT( visitedEarlyExits );
 		return S_FALSE;
+	}
+	if (this->previewActive)
+		this->SavePreviewRect( diamondX, diamondY );
 	this->isomMatchingData->GetIsomRect( diamondX, diamondY )->SetDirVisited( 0 );
 	this->changedArea.left   = (std::min)(this->changedArea.left,   diamondX );
 	this->changedArea.right  = (std::max)(this->changedArea.right,  diamondX );
@@ -1020,7 +3838,7 @@ HRESULT CIsoMap::SearchForMatch(	__in const TileCoordinate diamondX,
 	{
 		MapIsomData::IsomGroup searchStartGroup = groupSearchStartVals[i];
 		MapIsomData::IsomValue curIsomVal = this->isomMatchingData->GetIsomVal( searchStartGroup );
-		while (curIsomVal < this->isomMatchingData->isomDataTableLength)
+		while (curIsomVal * 13UL < this->isomMatchingData->isomDataTableLength)
 		{
 			//	See if we have started searching a different group.
 			if (this->isomMatchingData->isomDataTbl[curIsomVal * 13] != searchStartGroup)
@@ -1037,6 +3855,7 @@ HRESULT CIsoMap::SearchForMatch(	__in const TileCoordinate diamondX,
 						break;
 			}
 
+			ISOM_COUNT( candidatesTested );
 			hr = this->TestIsomValue( curIsomVal, &diamondMatchData );
 			++curIsomVal;
 		}
@@ -1049,16 +3868,11 @@ HRESULT CIsoMap::SearchForMatch(	__in const TileCoordinate diamondX,
 			return S_FALSE; // XXX: Should this set some alternative 'visited' flag?
 		}
 
-		hr = this->SetDiamondIsom(diamondX, diamondY, diamondMatchData.IsomVal, undoID, undoList);
+		hr = this->SetDiamondIsom(diamondX, diamondY, diamondMatchData.IsomVal, undo);
 		RETURNHRSILENT_IF_ERROR( hr );
 	}
 
-	for (size_t curDir=0;curDir<4;++curDir)
-	{
-		TileCoordinate neighborX = diamondX + diamondNeighborOffsets[curDir * 2 + 0];
-		TileCoordinate neighborY = diamondY + diamondNeighborOffsets[curDir * 2 + 1];
-		this->EnqueueTileUpdate( neighborX, neighborY );
-	}
+	this->EnqueueDiamondNeighbors( diamondX, diamondY );
 
 	return S_OK;
 }
@@ -1073,7 +3887,67 @@ DWORD CIsoMap::GetTileHash(WORD X, WORD Y)
 
 
 
+void CIsoMap::ResetHashCache( void )
+{
+	//	Flag bits are never part of a key, so this can't match a rect
+	for (size_t i=0;i<_countof(this->hashCache);i++)
+		this->hashCache[i].rectKey = ~0ULL;
+
+	this->hashCacheTable = (this->isomMatchingData != nullptr) ? this->isomMatchingData->isomDataTbl : nullptr;
+	this->hashCacheHits		= 0;
+	this->hashCacheMisses	= 0;
+
+	//	Rebuild the descriptors for the row hashes; without them those fall back to ComputeTileHash
+	this->numHashDescriptors = 0;
+	if (this->hashCacheTable == nullptr)
+		return;
+
+	const size_t numIsomValues = this->isomMatchingData->isomDataTableLength / 13;
+	if (FAILED( ALLOCATE_UNIQUEPTR_ARRAY( hashDescriptors, HashDescriptor, numIsomValues * 8 ) ))
+		return;
+
+	for (size_t isomValue=0;isomValue<numIsomValues;isomValue++)
+	{
+		for (size_t dirIndex=0;dirIndex<4;dirIndex++)
+		{
+			for (size_t dirTableIndex=0;dirTableIndex<2;dirTableIndex++)
+			{
+				HashDescriptor &descriptor = this->hashDescriptors[isomValue * 8 + dirIndex * 2 + dirTableIndex];
+				descriptor.borderValue	= this->hashCacheTable[isomValue * 13 + dirIndex * 3 + dirTableIndex + 1];
+				descriptor.isomGroup	= static_cast<MapIsomData::IsomGroup>( this->hashCacheTable[isomValue * 13] );
+			}
+		}
+	}
+	this->numHashDescriptors = numIsomValues * 8;
+}
+
 DWORD	CIsoMap::MakeHash( __in const MapIsomData::IsomRect *isomRect)
+{
+	const unsigned __int16 valueMask = static_cast<unsigned __int16>( ~(MapIsomData::IsomRect::ISOM_FLAG_SKIPPED | MapIsomData::IsomRect::ISOM_FLAG_EDITED) );
+	const unsigned __int64 rectKey =	(static_cast<unsigned __int64>( isomRect->values[0] & valueMask ) << 0) |
+										(static_cast<unsigned __int64>( isomRect->values[1] & valueMask ) << 16) |
+										(static_cast<unsigned __int64>( isomRect->values[2] & valueMask ) << 32) |
+										(static_cast<unsigned __int64>( isomRect->values[3] & valueMask ) << 48);
+
+	if (this->hashCacheTable != this->isomMatchingData->isomDataTbl)
+		this->ResetHashCache();
+
+	HashCacheEntry &cacheEntry = this->hashCache[(rectKey * 0x9E3779B97F4A7C15ULL) >> (64 - HASH_CACHE_BITS)];
+	if (cacheEntry.rectKey == rectKey)
+	{
+		++this->hashCacheHits;
+		ISOM_COUNT( hashCacheHits );
+		return cacheEntry.tileHash;
+	}
+
+	++this->hashCacheMisses;
+	ISOM_COUNT( hashCacheMisses );
+	cacheEntry.rectKey	= rectKey;
+	cacheEntry.tileHash	= this->ComputeTileHash( isomRect );
+	return cacheEntry.tileHash;
+}
+
+DWORD	CIsoMap::ComputeTileHash( __in const MapIsomData::IsomRect *isomRect)
 {
 	DWORD borderValues[4] = {};
 	MapIsomData::IsomGroup isomGroups[4] = {};
@@ -1111,3 +3985,125 @@ DWORD	CIsoMap::MakeHash( __in const MapIsomData::IsomRect *isomRect)
 	isomDataHash |= isomGroup;
 	return isomDataHash;
 }
+
+void CIsoMap::MakeRowHashes(	__in const MapIsomData::IsomRect *isomRects,
+								__in const size_t numRects,
+								__out DWORD *tileHashes )
+{
+	if (this->hashCacheTable != this->isomMatchingData->isomDataTbl)
+		this->ResetHashCache();
+
+	size_t rectIndex = 0;
+#ifdef ISOM_USE_SSE2
+	//	Unsigned compare of the border values against 0x30, via a signed compare on biased values
+	const __m128i signBias		= _mm_set1_epi32( static_cast<int>( 0x80000000 ) );
+	const __m128i minBorderBias	= _mm_set1_epi32( static_cast<int>( 0x80000000 + 0x30 - 1 ) );
+	const __m128i zero			= _mm_setzero_si128();
+
+	for (;rectIndex + 4 <= numRects;rectIndex += 4)
+	{
+		//	SSE2 has no gathers, so the descriptors of the four rects are fetched one lane at a time
+		__m128i borderValues[4];
+		__m128i isomGroups[4];
+		bool inRange = true;
+		for (size_t i=0;i<4 && inRange;i++)
+		{
+			size_t descriptorIndex[4];
+			for (size_t lane=0;lane<4;lane++)
+			{
+				descriptorIndex[lane] = isomRects[rectIndex + lane].GetRawIsomValue(i) >> 1;
+				if (descriptorIndex[lane] >= this->numHashDescriptors)
+					inRange = false;
+			}
+			if (! inRange)
+				break;
+
+			const HashDescriptor *descriptors = this->hashDescriptors.get();
+			borderValues[i]	= _mm_set_epi32(	static_cast<int>( descriptors[descriptorIndex[3]].borderValue ),
+												static_cast<int>( descriptors[descriptorIndex[2]].borderValue ),
+												static_cast<int>( descriptors[descriptorIndex[1]].borderValue ),
+												static_cast<int>( descriptors[descriptorIndex[0]].borderValue ) );
+			isomGroups[i]	= _mm_set_epi32(	static_cast<int>( descriptors[descriptorIndex[3]].isomGroup ),
+												static_cast<int>( descriptors[descriptorIndex[2]].isomGroup ),
+												static_cast<int>( descriptors[descriptorIndex[1]].isomGroup ),
+												static_cast<int>( descriptors[descriptorIndex[0]].isomGroup ) );
+		}
+
+		if (! inRange)
+		{
+			for (size_t lane=0;lane<4;lane++)
+				tileHashes[rectIndex + lane] = this->ComputeTileHash( &isomRects[rectIndex + lane] );
+			continue;
+		}
+
+		//	ComputeTileHash takes the group of the last direction with a border of at least 0x30 and a nonzero group,
+		//	so blend them in first to last
+		__m128i isomGroup = zero;
+		for (size_t i=0;i<4;i++)
+		{
+			const __m128i borderUsable	= _mm_cmpgt_epi32( _mm_xor_si128( borderValues[i], signBias ), minBorderBias );
+			const __m128i useGroup		= _mm_andnot_si128( _mm_cmpeq_epi32( isomGroups[i], zero ), borderUsable );
+			isomGroup = _mm_or_si128( _mm_and_si128( useGroup, isomGroups[i] ), _mm_andnot_si128( useGroup, isomGroup ) );
+		}
+
+		__m128i isomDataHash = zero;
+		for (size_t i=0;i<4;i++)
+			isomDataHash = _mm_slli_epi32( _mm_or_si128( isomDataHash, borderValues[i] ), 6 );
+		isomDataHash = _mm_or_si128( isomDataHash, isomGroup );
+
+		_mm_storeu_si128( reinterpret_cast<__m128i*>( tileHashes + rectIndex ), isomDataHash );
+	}
+#endif
+
+	for (;rectIndex<numRects;rectIndex++)
+		tileHashes[rectIndex] = this->ComputeTileHash( &isomRects[rectIndex] );
+
+#ifdef _DEBUG
+	//	The vector path has to give exactly the hashes of the scalar one
+	for (size_t i=0;i<numRects;i++)
+		assert( tileHashes[i] == this->ComputeTileHash( &isomRects[i] ) );
+#endif
+}
+
+HRESULT CIsoMap::VerifyRowHashes(	__in const DWORD seed,
+									__in const size_t numRects )
+{
+	HRESULT hr;
+	VERIFYMEMBER( this->isomMatchingData );
+	VERIFYMEMBER( this->isomMatchingData->isomDataTbl );
+
+	const size_t numIsomValues = this->isomMatchingData->isomDataTableLength / 13;
+	if (numIsomValues == 0)
+		return E_FAIL;
+
+	std::unique_ptr<MapIsomData::IsomRect[]>	isomRects;
+	std::unique_ptr<DWORD[]>					tileHashes;
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( isomRects, MapIsomData::IsomRect, numRects );
+	RETURNHRSILENT_IF_ERROR( hr );
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( tileHashes, DWORD, numRects );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	//	Any value within the table, with random direction and flag bits
+	for (size_t x=0;x<numRects;x++)
+	{
+		for (size_t i=0;i<4;i++)
+		{
+			const DWORD randomValue = GetTileRandom( seed, static_cast<TileCoordinate>( x ), static_cast<TileCoordinate>( i ) );
+			const size_t isomValue = (randomValue >> 4) % numIsomValues;
+			isomRects[x].SetRawIsomValue( i, static_cast<unsigned __int16>( (isomValue << 4) | (randomValue & 0x0F) ) );
+		}
+	}
+
+	//	Starting the row at each of the four lanes moves the split between vector groups and the scalar tail
+	for (size_t start=0;start<4 && start<numRects;start++)
+	{
+		this->MakeRowHashes( &isomRects[start], numRects - start, tileHashes.get() );
+		for (size_t x=start;x<numRects;x++)
+		{
+			if (tileHashes[x - start] != this->ComputeTileHash( &isomRects[x] ))
+				return E_FAIL;
+		}
+	}
+
+	return S_OK;
+}
@@ -2,27 +2,165 @@
 #define SI__CIsoMap
 
 #include <list>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 #include "V3\\Map\\MapIsomData.h"
 #include "CSCMDundo.h"
 
 class CScmdraftUndo;
 
+class CIsoMap;
+class IsomUndoSpill;
+class IsomUndoSpillFile;
+
+//	The isom changes recorded under one undo ID, as runs of rects along rows.
+//	A run is its x, y and number of rects, followed by one mask word per four rects that flags
+//	the changed values of each rect, and then the XOR of the old and new value of every flagged value.
+//	Applying the record flips the rects between their old and new values, so undo and redo are
+//	the same single pass over the data.
+//	Migrating a host: nodes used to hold one rect each, in xPos, yPos, oldSettings and newSettings,
+//	which the UNDO_ISOMCHANGE handler wrote back into the map. The handler now calls
+//	CIsoMap::ApplyUndoNode on the node for both undo and redo, and then FinalizeTerrain as before.
 class IsomUndoNode
 	:	public UndoNodeBase
 {
 public:
-							IsomUndoNode( void ) : UndoNodeBase( UNDO_ISOMCHANGE ) {}
+							IsomUndoNode( void );
+							~IsomUndoNode( void );
 
-	TileCoordinate			xPos;
-	TileCoordinate			yPos;
+	//	Flags the flipped rects as changed and adds them to the changed area
+	HRESULT					Apply(	__inout MapIsomData *isomData,
+									__inout TileRect *changedArea );
 
-	struct Settings
+	size_t					GetEncodedSize( void ) const { return this->spillWords * sizeof(WORD); }
+
+private:
+	friend class CIsoMap;
+	friend class IsomUndoSpill;
+
+	//	Reads the data back from the spill file
+	HRESULT					ReadSpilledData( void );
+
+	CIsoMap					*isoMap;	// Set while the map is still recording into this node
+	std::unique_ptr<WORD[]>	data;		// Empty while spilled
+
+	IsomUndoSpill			*spill;			// Set while the spill of the map keeps track of this node
+	IsomUndoNode			*prevSpillNode;
+	IsomUndoNode			*nextSpillNode;
+	bool					isSpilled;
+	std::shared_ptr<IsomUndoSpillFile>	spillFile;	// The file the data was written to, if it ever was
+	unsigned __int64		spillOffset;
+	size_t					spillWords;		// Size of the data, also while spilled
+	size_t					spillPackedWords;	// Size of the data in the spill file
+
+							IsomUndoNode( const IsomUndoNode & );
+	IsomUndoNode			&operator=( const IsomUndoNode & );
+};
+
+//	The file spilled undo data is appended to. The spill and every node with data in it share the file,
+//	and it is deleted once the last of them lets go of it. Until then it only grows: the space of
+//	deleted nodes is not reclaimed.
+//	The data is run length encoded in words on the way out. A header word with the top bit set is
+//	followed by one word repeated (header & 0x7FFF) times, otherwise by that many words as they are.
+//	Long stretches of the same mask and delta words are what large terrain edits record.
+class IsomUndoSpillFile
+{
+public:
+							IsomUndoSpillFile( void );
+							~IsomUndoSpillFile( void );
+
+	HRESULT					Open(	__in const std::string &path );
+	HRESULT					Append(	__in const WORD *data,
+									__in const size_t numWords,
+									__out unsigned __int64 *offset,
+									__out size_t *packedWords );
+	HRESULT					Read(	__in const unsigned __int64 offset,
+									__in const size_t packedWords,
+									__out WORD *data,
+									__in const size_t numWords );
+
+private:
+	static const WORD		REPEAT_FLAG		= 0x8000;
+	static const size_t		MAX_RUN_WORDS	= 0x7FFF;
+
+	static void				Pack(	__in const WORD *data,
+									__in const size_t numWords,
+									__out std::vector<WORD> *packed );
+	static HRESULT			Unpack(	__in const WORD *packed,
+									__in const size_t packedWords,
+									__out WORD *data,
+									__in const size_t numWords );
+
+	std::string				path;
+	std::fstream			file;
+	unsigned __int64		fileSize;
+	std::vector<WORD>		packBuffer;
+
+							IsomUndoSpillFile( const IsomUndoSpillFile & );
+	IsomUndoSpillFile		&operator=( const IsomUndoSpillFile & );
+};
+
+//	A rect recorded under the open undo node
+struct IsomUndoCell
+{
+	MapIsomData::IsomRect	oldRect;
+	MapIsomData::IsomRect	newRect;
+};
+
+//	Keeps the data of sealed undo nodes within a memory budget. Past the budget, the data of the
+//	least recently used nodes is appended to a spill file and freed, and read back in when such a
+//	node is applied. A node's data never changes once sealed, so it is written at most once.
+//	Nodes are kept in intrusive lists, so no operation depends on the length of the history.
+//	Spilled nodes keep their spill file alive, so they can still be applied after the spill is gone.
+class IsomUndoSpill
+{
+public:
+							IsomUndoSpill( void );
+							~IsomUndoSpill( void );
+
+	//	A budget of 0 keeps everything in memory
+	HRESULT					SetBudget(	__in const size_t budgetBytes,
+										__in const char *spillPath );
+
+	HRESULT					Track(	__inout IsomUndoNode *undoNode );
+	//	A spilled node stays spilled. Its data stays in the spill file, which doesn't get smaller.
+	void					Untrack(	__inout IsomUndoNode *undoNode );
+	//	On failure the node stays spilled, so applying it can be tried again
+	HRESULT					PageIn(	__inout IsomUndoNode *undoNode );
+
+	size_t					GetResidentBytes( void ) const { return this->residentBytes; }
+
+private:
+	struct NodeList
 	{
-		MapIsomData::IsomRect	isom;
+		IsomUndoNode		*first;	// Least recently used
+		IsomUndoNode		*last;
 	};
 
-	Settings				oldSettings;
-	Settings				newSettings;
+	static void				Link(	__inout NodeList *nodeList,
+									__inout IsomUndoNode *undoNode );
+	static void				Unlink(	__inout NodeList *nodeList,
+									__inout IsomUndoNode *undoNode );
+
+	HRESULT					Spill(	__inout IsomUndoNode *undoNode );
+	HRESULT					EnforceBudget( void );
+
+	NodeList				residentNodes;
+	NodeList				spilledNodes;
+	size_t					residentBytes;
+	size_t					budgetBytes;
+
+	std::string				spillPath;
+	std::shared_ptr<IsomUndoSpillFile>	spillFile;	// Created on the first spill
+
+							IsomUndoSpill( const IsomUndoSpill & );
+	IsomUndoSpill			&operator=( const IsomUndoSpill & );
 };
 
 
@@ -61,11 +199,265 @@ struct MatchNode
 };
 
 
+//	Work counters for the matching and finalization.
+//	Only gathered when SI_ISOM_STATISTICS is defined, otherwise the counting compiles away.
+struct IsomCounters
+{
+	size_t					nodesEnqueued;
+	size_t					duplicatesFiltered;	// Nodes rejected by GetDiamondNeedsUpdate, either when enqueued or popped
+	size_t					searchCalls;		// SearchForMatch calls
+	size_t					visitedEarlyExits;	// SearchForMatch calls that stopped on the visited flag
+	size_t					candidatesTested;	// Isom values passed to TestIsomValue
+	size_t					diamondsChanged;
+	size_t					tilesFinalized;		// PlaceFinalTerrain calls
+	size_t					cliffStackSteps;	// Rows walked up and down cliff stacks by PlaceFinalTerrain
+	size_t					hashCacheHits;		// MakeHash calls answered from the hash cache
+	size_t					hashCacheMisses;
+	size_t					undoCellsRecorded;
+
+	void					Add(	__in const IsomCounters &other );
+};
+
+struct IsomStatistics
+{
+	enum Operation
+	{
+		OP_PLACETERRAIN,		// PlaceTerrain, PlaceTerrainStroke and propagating jobs
+		OP_FINALIZETERRAIN,		// FinalizeTerrain and finalizing jobs
+		OP_FINALIZERESIZE,
+		OP_PASTEREGION,
+		OP_COUNT,
+	};
+
+	size_t					numCalls[OP_COUNT];
+	IsomCounters			lastCall[OP_COUNT];
+	IsomCounters			totals[OP_COUNT];
+};
+
+#ifdef SI_ISOM_STATISTICS
+
+//	Attributes the counters gathered while in scope to one operation
+class IsomStatisticsScope
+{
+public:
+							IsomStatisticsScope(	__inout IsomStatistics *statistics,
+													__inout IsomCounters *activeCounters,
+													__in const IsomStatistics::Operation operation );
+							~IsomStatisticsScope( void );
+private:
+	IsomStatistics			*statistics;
+	IsomCounters			*activeCounters;
+	IsomStatistics::Operation	operation;
+};
+
+#define ISOM_COUNT( counterName )				(++this->activeCounters.counterName)
+#define ISOM_STATISTICS_SCOPE( isoMap, op )		IsomStatisticsScope isomStatisticsScope( &(isoMap)->statistics, &(isoMap)->activeCounters, op )
+
+#else
+
+#define ISOM_COUNT( counterName )				((void)0)
+#define ISOM_STATISTICS_SCOPE( isoMap, op )		((void)0)
+
+#endif
+
+
 class MapTerrain;
 class TerrainLayer;
+class SI_CTileset;
+class CIsoMap;
+class IsomTerrainJob;
+namespace TerrainData { struct TileGroupInfo; }
+
+
+//	Undo policies the placement and propagation code is instantiated for.
+//	With NoUndo the undo bookkeeping is compiled out of the per-rect path.
+struct NoUndo
+{
+};
+
+struct RecordUndo
+{
+							RecordUndo(	__in const DWORD undoID,
+										__in CScmdraftUndo *undoList ) : undoID( undoID ), undoList( undoList ) {}
+
+	DWORD					undoID;
+	CScmdraftUndo			*undoList;
+};
+
+//	Saves every rect a job changes so the job can be cancelled, and records undo if the job has an undo list
+struct JobUndo
+{
+	explicit				JobUndo(	__in IsomTerrainJob *job ) : job( job ) {}
+
+	IsomTerrainJob			*job;
+};
+
+
+//	A rect as it was before a change. The offset is x + y * width.
+struct IsomRestoreRect
+{
+	size_t					offset;
+	MapIsomData::IsomRect	isomRect;
+};
+
+
+//	One tile written by the finalization
+struct TileDelta
+{
+	WORD					tileX;
+	WORD					tileY;
+	SCEngine::TileIndex		tileIndex;
+};
+
+
+//	Alias table over the subtiles of a tile group that have a megatile.
+//	The low 4 bits of a random number pick a column, the rest decide between
+//	the column and its alias, so each sample takes one number and no retries.
+struct SubtileAliasTable
+{
+	static const DWORD		THRESHOLD_ONE = 1 << 28;
+
+	DWORD					threshold[16];
+	BYTE					alias[16];
+
+	void					Build(	__in const TerrainData::TileGroupInfo *tileGroupInfo );
+	unsigned __int16		Sample(	__in const DWORD randomValue ) const
+	{
+		const DWORD column = randomValue & 0x0F;
+		return ((randomValue >> 4) < this->threshold[column]) ? static_cast<unsigned __int16>( column ) : this->alias[column];
+	}
+};
+
+
+//	Threads that are started once and then wait for work, so finalizing doesn't start new threads every time
+class IsomWorkerPool
+{
+public:
+							IsomWorkerPool( void );
+							~IsomWorkerPool( void );
+
+	//	Calls work with worker indices 0 to numWorkers - 1 and returns once all calls are done.
+	//	Index 0 runs on the calling thread. If threads can't be started, fewer indices are used.
+	void					Run(	__in const size_t numWorkers,
+									__in const std::function<void( size_t )> &work );
+private:
+	std::vector<std::thread>	threads;
+	std::mutex				lock;
+	std::condition_variable	workReady;
+	std::condition_variable	workDone;
+
+	const std::function<void( size_t )>	*work;
+	size_t					numWorkingThreads;	// The threads that take part in the current batch
+	size_t					numBusyThreads;
+	DWORD					batch;				// Bumped for every Run, so each thread takes part once
+	bool					shuttingDown;
+
+	//	Started during a Run, before the batch is bumped
+	void					ThreadLoop(	__in const size_t threadIndex,
+										__in DWORD lastBatch );
+
+							IsomWorkerPool(	__in const IsomWorkerPool& );
+	IsomWorkerPool&			operator=(	__in const IsomWorkerPool& );
+};
+
+
+//	A brush shape, rasterized into diamond offsets from the brush position.
+//	Shapes are defined in the rotated brush space used by the square brush, where
+//	a step along a brush axis moves to a neighboring diamond.
+//	The diamonds just outside the shape are worked out once when the shape is created,
+//	so placing the brush only ever enqueues its true boundary.
+class IsomBrush
+{
+public:
+							IsomBrush( void );
+
+	HRESULT					CreateSquare(	__in const size_t brushExtent );
+
+	HRESULT					CreateEllipse(	__in const size_t radiusA,
+											__in const size_t radiusB );
+
+	//	Row major mask in brush space, any non zero byte is part of the brush.
+	//	The mask is centered on the brush position the same way a square brush of that size is.
+	HRESULT					CreateFromMask(	__in const BYTE *mask,
+											__in const size_t maskWidth,
+											__in const size_t maskHeight );
+
+	size_t					GetNumDiamonds( void ) const { return this->diamondOffsets.size(); }
+
+private:
+	friend class CIsoMap;
+
+	HRESULT					Rasterize(	__in const BYTE *mask,
+										__in const size_t maskWidth,
+										__in const size_t maskHeight,
+										__in const int startA,
+										__in const int startB );
+
+	std::vector<POINT>		diamondOffsets;
+	std::vector<POINT>		boundaryOffsets; // Diamonds outside the shape that touch it, each listed once
+};
+
+
+//	A terrain edit that can be advanced in small steps, so that callers can interleave
+//	other work with the matching and the tile finalization.
+//	Started with CIsoMap::BeginPlaceTerrain or CIsoMap::BeginFinalizeTerrain.
+//	Until the job completes or is cancelled it owns the changed and visited flags of the map,
+//	and the other isom edits of the CIsoMap return E_PENDING.
+//	The cliff stack cache is rebuilt once before finalizing, so tiles changed outside of the job
+//	after that aren't seen by it.
+class IsomTerrainJob
+{
+public:
+							IsomTerrainJob( void );
+							~IsomTerrainJob( void );
+
+	//	Runs at most maxSteps nodes or tiles, or until maxMilliseconds have passed. 0 means no limit.
+	//	Returns S_OK once the job has completed, and S_FALSE while there is work left.
+	HRESULT					Advance(	__in TerrainLayer &terrainLayerEditor,
+										__in const size_t maxSteps,
+										__in const DWORD maxMilliseconds );
+
+	//	Puts back the isom values from before the job started, and retiles the area the job touched.
+	//	The restore is recorded under the job's undo ID, so it cancels out what the job recorded there.
+	HRESULT					Cancel(	__in TerrainLayer &terrainLayerEditor );
+
+	bool					IsComplete( void ) const { return this->phase == JOB_COMPLETE; }
+
+private:
+	friend class CIsoMap;
+
+							IsomTerrainJob(	__in const IsomTerrainJob & );
+	IsomTerrainJob&			operator=(	__in const IsomTerrainJob & );
+
+	void					Release( void );
+
+	enum JobPhase
+	{
+		JOB_IDLE,
+		JOB_PROPAGATE,
+		JOB_REFRESH,	// Rebuilding the cliff stack cache over the dirty area, a column at a time
+		JOB_FINALIZE,
+		JOB_COMPLETE,
+	};
+
+	CIsoMap					*isoMap;
+	JobPhase				phase;
+	DWORD					undoID;
+	CScmdraftUndo			*undoList;
+
+	std::list<MatchNode>	isomStack;
+	TileRect				dirtyArea; // In isom. coordinates
+	TileCoordinate			cursorX;
+	TileCoordinate			cursorY;
+
+	std::vector<IsomRestoreRect>	restoreRects; // In the order the rects were changed
+};
+
 
 class CIsoMap
 {
+	friend class IsomTerrainJob;
+	friend class IsomUndoNode;
 protected:
 	MapIsomData				*isomMatchingData;
 	MapTerrain				*mapTerrain;
@@ -89,14 +481,59 @@ public:
 										__in CScmdraftUndo *undoList );
 
 protected:
+	//	Direct mapped cache of tile hashes, keyed by the rect contents without flags.
+	//	Only valid for the isom data table it was filled from.
+	struct HashCacheEntry
+	{
+		unsigned __int64	rectKey;
+		DWORD				tileHash;
+	};
+	static const size_t		HASH_CACHE_BITS = 10;
+	HashCacheEntry			hashCache[1 << HASH_CACHE_BITS];
+	const DWORD				*hashCacheTable;
+	size_t					hashCacheHits;
+	size_t					hashCacheMisses;
+
+	//	The parts of the isom data table the tile hash uses, indexed by raw isom value >> 1
+	struct HashDescriptor
+	{
+		DWORD				borderValue;
+		DWORD				isomGroup;
+	};
+	std::unique_ptr<HashDescriptor[]>	hashDescriptors;
+	size_t					numHashDescriptors;
+
+	void					ResetHashCache( void );
+
 	DWORD					MakeHash(	__in const MapIsomData::IsomRect *isomRect );
+	DWORD					ComputeTileHash(	__in const MapIsomData::IsomRect *isomRect );
+
+	//	Same results as MakeHash for a span of rects, for finalizing whole rows
+	void					MakeRowHashes(	__in const MapIsomData::IsomRect *isomRects,
+											__in const size_t numRects,
+											__out DWORD *tileHashes );
 
 	DWORD					GetTileHash(WORD X, WORD Y);
 
 
-	std::unique_ptr<IsomUndoNode*[]>	undoNodeTable;
+	//	Rects recorded since the open undo node was added, encoded into it once it is sealed
+	IsomUndoNode			*openUndoNode;
+	std::unique_ptr<IsomUndoCell[]>	undoCellTable;
+	std::unique_ptr<DWORD[]>	undoCellGenerations;	// A cell is recorded if this matches undoCellGeneration
+	DWORD					undoCellGeneration;
+	std::vector<size_t>		undoCells;				// Offsets of the recorded cells
+	bool					undoCoalescing;
+
+	IsomUndoSpill			undoSpill;
+	std::vector<WORD>		undoEncodeBuffer;		// Node data is encoded here, then copied into the node
+
+	//	Moves the encoded data into the node
+	void					StoreUndoData(	__inout IsomUndoNode *undoNode );
 
 	TileRect				changedArea;
+
+	//	The unfinished job, if any. The flags in the map belong to it until it is done.
+	IsomTerrainJob			*activeJob;
 public:
 	HRESULT					ResetChangedArea( void );
 
@@ -107,24 +544,243 @@ public:
 											__in const DWORD undoID,
 											__in CScmdraftUndo *undoList );
 
+	//	Same as PlaceTerrain, but with an arbitrary brush shape
+	HRESULT					PlaceTerrainBrush(	__in const TileCoordinate X,
+												__in const TileCoordinate Y,
+												__in SCEngine::TileGroupID tileGroupID,
+												__in const IsomBrush &brush,
+												__in const DWORD undoID,
+												__in CScmdraftUndo *undoList );
+
+	//	Stamps the brush at every position along the polyline, and then runs the matching
+	//	only once from the outer boundary of the union of all stamps.
+	HRESULT					PlaceTerrainStroke(	__in const POINT *strokePoints,
+												__in const size_t numStrokePoints,
+												__in SCEngine::TileGroupID tileGroupID,
+												__in const size_t brushExtent,
+												__in const DWORD undoID,
+												__in CScmdraftUndo *undoList );
+
+	//	Replaces the connected region of diamonds sharing the isom value at X, Y with a new terrain type.
+	//	Only the border of the region gets matched.
+	HRESULT					FillTerrain(	__in const TileCoordinate X,
+											__in const TileCoordinate Y,
+											__in SCEngine::TileGroupID tileGroupID,
+											__in const DWORD undoID,
+											__in CScmdraftUndo *undoList );
+
+	//	Returns the tiles a PlaceTerrain followed by a FinalizeTerrain would write, sorted by row.
+	//	The isom data, the terrain layer and the undo list are left as they were: the placement runs
+	//	on the map itself, and every rect and cliff stack entry it touches is put back afterwards.
+	HRESULT					PreviewTerrain(	__in const TileCoordinate X,
+											__in const TileCoordinate Y,
+											__in SCEngine::TileGroupID tileGroupID,
+											__in const size_t brushExtent,
+											__out std::vector<TileDelta> *tileDeltas );
+	//	Runs PreviewTerrain and fails unless the isom data, flags included, and the cliff stack cache
+	//	are byte for byte what they were before it
+	HRESULT					VerifyPreviewTerrain(	__in const TileCoordinate X,
+													__in const TileCoordinate Y,
+													__in SCEngine::TileGroupID tileGroupID,
+													__in const size_t brushExtent );
+
+	//	Swaps every diamond of one terrain type for another across the whole map,
+	//	followed by a single matching pass over the borders of all replaced regions.
+	HRESULT					ReplaceTerrain(	__in SCEngine::TileGroupID fromTileGroupID,
+											__in SCEngine::TileGroupID toTileGroupID,
+											__in const DWORD undoID,
+											__in CScmdraftUndo *undoList );
+
+	//	Copies the rects of srcRect (isom coordinates, right and bottom inclusive) from source to dstX, dstY,
+	//	clipped to the map. Only the seam around the pasted rects gets matched, the pasted rects are kept as is.
+	//	The changed area covers the pasted rects and the seam, ready for FinalizeTerrain.
+	HRESULT					PasteRegion(	__in MapIsomData *source,
+											__in const TileRect &srcRect,
+											__in const TileCoordinate dstX,
+											__in const TileCoordinate dstY,
+											__in const DWORD undoID,
+											__in CScmdraftUndo *undoList );
+
 	HRESULT					FinalizeTerrain(	__in TerrainLayer &terrainLayerEditor );
+
+	//	Regenerates every tile of the map from the isom data in a single sweep.
+	//	Each cliff stack gets resolved once, instead of once per tile in the stack.
+	HRESULT					RebuildTerrain(	__in TerrainLayer &terrainLayerEditor );
+
+	//	Same as PlaceTerrain followed by FinalizeTerrain, but the work is done by IsomTerrainJob::Advance
+	HRESULT					BeginPlaceTerrain(	__in const TileCoordinate X,
+												__in const TileCoordinate Y,
+												__in SCEngine::TileGroupID tileGroupID,
+												__in const size_t brushExtent,
+												__in const DWORD undoID,
+												__in CScmdraftUndo *undoList,
+												__out IsomTerrainJob *job );
+
+	HRESULT					BeginFinalizeTerrain(	__out IsomTerrainJob *job );
+
+	//	Returns E_NOTIMPL unless built with SI_ISOM_STATISTICS
+	HRESULT					GetStatistics(	__out IsomStatistics *statistics ) const;
+	void					ResetStatistics( void );
+
+	//	Counted in every build. Since the tile hash cache was last flushed, which happens when the tileset changes.
+	HRESULT					GetHashCacheCounters(	__out size_t *hits,
+													__out size_t *misses ) const;
+
+	//	Hashes rows of random rects with the row hashing and with ComputeTileHash, and fails if any
+	//	hash differs. Runs in every build, so the vector path gets checked on the machine it runs on.
+	HRESULT					VerifyRowHashes(	__in const DWORD seed,
+												__in const size_t numRects );
+
+	//	The tiles written by the last finalization (or job slice), in row order
+	const std::vector<TileDelta>&	GetTileDeltas( void ) const;
+
+	//	Once a seed is set, subtiles are picked from the seed and the tile position, so finalizing gives
+	//	the same result no matter in which order or on how many threads the columns are done.
+	//	Until then they come from the tileset's random generator as before, and finalizing stays on one thread.
+	void					SetTerrainSeed(	__in const DWORD seed );
+	//	Most threads to finalize large areas with, 0 to use one per hardware thread. Only used once a seed is set.
+	void					SetFinalizeThreadLimit(	__in const size_t maxThreads );
+
+	//	Retiles the whole map once on one thread and once on up to maxThreads, without committing
+	//	either, and fails if any tile differs. Needs a seed. The isom data and the tiles are left as they were.
+	HRESULT					VerifyFinalizeThreads(	__in const size_t maxThreads );
+
+	//	Undoes or redoes an isom undo node, FinalizeTerrain then retiles the flipped rects
+	HRESULT					ApplyUndoNode(	__inout IsomUndoNode *undoNode );
+
+	//	Caps the memory used by the data of this map's undo nodes, the rest is moved to the spill file.
+	//	A budget of 0 keeps all of it in memory.
+	HRESULT					SetUndoMemoryBudget(	__in const size_t budgetBytes,
+													__in const char *spillPath );
+	size_t					GetUndoResidentBytes( void ) const { return this->undoSpill.GetResidentBytes(); }
+
+	//	Between these, changes recorded under any undo ID go into the node of the first one, so a drag
+	//	stroke that stamps with a fresh undo ID each time becomes a single undo step. Each rect is
+	//	recorded once, with its value from before the stroke.
+	HRESULT					BeginUndoCoalescing( void );
+	HRESULT					EndUndoCoalescing( void );
 private:
+	IsomStatistics			statistics;
+	IsomCounters			activeCounters;
+
+	//	Top tile row of the cliff stack each tile column pair and row is part of.
+	//	Only valid for the area being finalized, it is refreshed at the start of every finalization.
+	std::unique_ptr<WORD[]>	cliffStackTop;
+
+	DWORD					terrainSeed;
+	bool					terrainSeeded;
+	size_t					finalizeThreadLimit;
+	IsomWorkerPool			finalizeWorkers;
+
+	//	Per tile group of subtileTablesTileset, built before finalizing
+	std::unique_ptr<SubtileAliasTable[]>	subtileTables;
+	size_t					numSubtileTables;
+	const SI_CTileset		*subtileTablesTileset;
+
+	HRESULT					PrepareSubtileTables( void );
+	unsigned __int16		SampleSubtile(	__in const unsigned __int16 tileGroup,
+											__in const TerrainData::TileGroupInfo *tileGroupInfo,
+											__in const TileCoordinate X,
+											__in const TileCoordinate Y ) const;
+
+	//	Finalization writes tiles here first, and reads its own writes back from here,
+	//	until they are committed to the terrain layer in one batch
+	std::vector<TileDelta>	tileDeltas;
+	std::unique_ptr<SCEngine::TileIndex[]>	stagedTiles;
+	std::unique_ptr<DWORD[]>	stagedTileGenerations;	// A tile is staged if this matches stagedTileGeneration
+	DWORD					stagedTileGeneration;
+	size_t					stagedTilesWidth;
+	size_t					stagedTilesHeight;
+
+	void					BeginTileDeltas( void );
+	void					UnstageTiles( void );
+	SCEngine::TileIndex		GetFinalTileIndex(	__in const TileCoordinate tileX,
+												__in const TileCoordinate tileY ) const;
+	void					StageTileIndex(	__inout std::vector<TileDelta> *tileDeltas,
+											__in const TileCoordinate tileX,
+											__in const TileCoordinate tileY,
+											__in const SCEngine::TileIndex tileIndex );
+	void					SortTileDeltas( void );
+	HRESULT					CommitTileDeltas(	__in TerrainLayer &terrainLayerEditor );
+
+	//	Original contents of the rects and cliff stack entries changed during a preview
+	typedef IsomRestoreRect	PreviewRect;
+	bool					previewActive;
+	std::vector<PreviewRect>	previewRects;
+	std::vector<std::pair<size_t, WORD>>	previewCliffStackTops;
+
+	void					SavePreviewRect(	__in const TileCoordinate x,
+												__in const TileCoordinate y );
+	void					RestorePreview( void );
+
+	//	The overloads taking an undo ID and list pick the undo policy once and call the templated version
 	HRESULT					InternalPlaceIsom(	__in const TileCoordinate X,
 												__in const TileCoordinate Y,
 												__in const size_t brushExtent,
 												__in DWORD isomVal,
 												__in const DWORD undoID,
 												__in CScmdraftUndo *undoList );
+	template <typename UndoPolicy>
+	HRESULT					InternalPlaceIsom(	__in const TileCoordinate X,
+												__in const TileCoordinate Y,
+												__in const size_t brushExtent,
+												__in DWORD isomVal,
+												__in const UndoPolicy &undo );
+
+	template <typename UndoPolicy>
+	HRESULT					StampIsomSquare(	__in const TileCoordinate X,
+												__in const TileCoordinate Y,
+												__in const size_t brushExtent,
+												__in const MapIsomData::IsomValue isomVal,
+												__in const bool skipStampedDiamonds,
+												__in const UndoPolicy &undo );
+
+	//	Expands the diamonds on the border of the area over the rects outside of it, walls the area off
+	//	from the matching, and enqueues the outside neighbors
+	template <typename UndoPolicy>
+	HRESULT					EnqueueAreaSeam(	__in const TileRect &innerArea,
+												__in const bool fixBorders,
+												__in const UndoPolicy &undo );
+
+	//	Enqueues the neighbors of the outside edge of a square brush
+	HRESULT					EnqueueSquareBorder(	__in const TileCoordinate X,
+													__in const TileCoordinate Y,
+													__in const size_t brushExtent );
+
+	//	Runs the matching until the isom stack is empty
+	HRESULT					PropagateIsomChanges(	__in const DWORD undoID,
+													__in CScmdraftUndo *undoList );
+	template <typename UndoPolicy>
+	HRESULT					PropagateIsomChanges(	__in const UndoPolicy &undo );
+
+	//	Pops one node off the isom stack and matches it. Returns false if the stack was empty.
+	template <typename UndoPolicy>
+	bool					ProcessNextIsomNode(	__in const UndoPolicy &undo );
+
+	//	Fill helper. Diamond neighbors are axis aligned in (u, v) space, with x = u - v and y = u + v.
+	bool					IsInFillRegion(	__in const long u,
+											__in const long v,
+											__in const MapIsomData::IsomValue regionIsomVal );
 
 	bool					GetDiamondNeedsUpdate(	__in const TileCoordinate diamondX,
 													__in const TileCoordinate diamondY );
+	static bool				GetRectNeedsUpdate(	__in const MapIsomData::IsomRect *diamondRect );
 
 	HRESULT					EnqueueTileUpdate(	__in const TileCoordinate diamondX,
 												__in const TileCoordinate diamondY );
+	//	Enqueues the four neighbors of a diamond; skips the bounds checks when the map has a guard band
+	void					EnqueueDiamondNeighbors(	__in const TileCoordinate diamondX,
+														__in const TileCoordinate diamondY );
 
 	// The changed area is in isom. coordinates
 	HRESULT					InternalFinalizeTerrain(	__in const TileRect &changedArea,
 														__in TerrainLayer &terrainLayerEditor );
+	//	InternalFinalizeTerrain without the commit, the tiles are left in tileDeltas
+	HRESULT					StageFinalTerrain(	__in const TileRect &changedArea );
+
+	void					FinalizeIsomRect(	__in const TileCoordinate X,
+												__in const TileCoordinate Y,
+												__inout std::vector<TileDelta> *tileDeltas );
 
 
 private:
@@ -132,19 +788,75 @@ private:
 												__in const TileCoordinate tileY,
 												__in const DWORD undoID,
 												__in CScmdraftUndo *undoList );
+	IsomUndoCell			*GetUndoCell(	__in const size_t cellOffset ) const;
+	HRESULT					OpenUndoNode(	__in const DWORD undoID,
+											__in CScmdraftUndo *undoList );
+	//	Encodes the recorded cells into the open undo node and stops recording into it
+	void					SealUndoNode( void );
+	void					DetachUndoNode( void );
+
+	//	Undo for bulk changes, recorded by copying the rows of the areas before the change and
+	//	diffing them against the map afterwards. Only valid for areas within the map which don't overlap.
+	HRESULT					BeginUndoSnapshot(	__in const TileRect *areas,
+												__in const size_t numAreas,
+												__out std::unique_ptr<MapIsomData::IsomRect[]> *snapshot );
+	HRESULT					CommitUndoSnapshot(	__in const TileRect *areas,
+												__in const size_t numAreas,
+												__in const MapIsomData::IsomRect *snapshot,
+												__in const DWORD undoID,
+												__in CScmdraftUndo *undoList );
 
+	template <typename UndoPolicy>
 	HRESULT					SetDiamondIsom(		__in const TileCoordinate diamondX,
 												__in const TileCoordinate diamondY,
 												__in const MapIsomData::IsomValue isomVal,
-												__in const DWORD undoID,
-												__in CScmdraftUndo *undoList );
+												__in const UndoPolicy &undo );
+
+	//	Bodies of the terrain operations, run once the undo policy has been picked
+	template <typename UndoPolicy>
+	HRESULT					FillIsomRegion(		__in const TileCoordinate diamondX,
+												__in const TileCoordinate diamondY,
+												__in const MapIsomData::IsomValue regionIsomVal,
+												__in const MapIsomData::IsomValue isomVal,
+												__in const UndoPolicy &undo );
+	template <typename UndoPolicy>
+	HRESULT					ReplaceIsomDiamonds(	__in const std::vector<POINT> &diamonds,
+													__in const MapIsomData::IsomValue isomVal,
+													__in const UndoPolicy &undo );
+	template <typename UndoPolicy>
+	HRESULT					StampIsomBrush(		__in const TileCoordinate diamondX,
+												__in const TileCoordinate diamondY,
+												__in const IsomBrush &brush,
+												__in const MapIsomData::IsomValue isomVal,
+												__in const UndoPolicy &undo );
+	template <typename UndoPolicy>
+	HRESULT					StampIsomStroke(	__in const std::vector<POINT> &stampPositions,
+												__in const size_t brushExtent,
+												__in const MapIsomData::IsomValue isomVal,
+												__in const UndoPolicy &undo );
 
+	template <typename UndoPolicy>
 	HRESULT					SetTileIsom(		__in const TileCoordinate tileX,
 												__in const TileCoordinate tileY,
 												__in const size_t dir,
 												__in const MapIsomData::IsomValue isomVal,
-												__in const DWORD undoID,
-												__in CScmdraftUndo *undoList );
+												__in const UndoPolicy &undo );
+
+	//	Records the rect for undo before it is changed, returns the cell to put the new value in
+	IsomUndoCell			*RecordUndoCell(	__in const NoUndo &,
+												__in const TileCoordinate,
+												__in const TileCoordinate ) { return nullptr; }
+	IsomUndoCell			*RecordUndoCell(	__in const RecordUndo &undo,
+												__in const TileCoordinate tileX,
+												__in const TileCoordinate tileY );
+	IsomUndoCell			*RecordUndoCell(	__in const JobUndo &undo,
+												__in const TileCoordinate tileX,
+												__in const TileCoordinate tileY );
+
+	//	Writes a saved rect back and flags it to be retiled
+	template <typename UndoPolicy>
+	void					RestoreIsomRect(	__in const IsomRestoreRect &restoreRect,
+												__in const UndoPolicy &undo );
 
 
 	HRESULT					PrepareSearchNode(	__in const TileCoordinate diamondX,
@@ -154,10 +866,10 @@ private:
 	bool					IsInBounds(	__in const TileCoordinate diamondX,
 										__in const TileCoordinate diamondY );
 
+	template <typename UndoPolicy>
 	HRESULT					SearchForMatch(		__in const TileCoordinate diamondX,
 												__in const TileCoordinate diamondY,
-												__in const DWORD undoID,
-												__in CScmdraftUndo *undoList );
+												__in const UndoPolicy &undo );
 
 	//	See if the isom value matches more sides than the current best match
 	HRESULT					TestIsomValue(	__in const MapIsomData::IsomValue isomVal,
@@ -165,7 +877,41 @@ private:
 
 	void					PlaceFinalTerrain(	__in const TileCoordinate X,
 												__in const TileCoordinate Y,
-												__in TerrainLayer &terrainLayerEditor );
+												__inout std::vector<TileDelta> *tileDeltas );
+
+	//	Places the tile group for (X, Y), returns false if nothing to stack was placed
+	bool					PlaceFinalTile(	__in const TileCoordinate X,
+											__in const TileCoordinate Y,
+											__in const DWORD tileHash,
+											__inout std::vector<TileDelta> *tileDeltas,
+											__out unsigned __int16 *destSubTile );
+
+	//	Applies the subtile to the cliff stack containing (X, Y) and fixes up the rows below it
+	void					ResolveCliffStack(	__in const TileCoordinate X,
+												__in const TileCoordinate Y,
+												__in const unsigned __int16 destSubTile,
+												__inout std::vector<TileDelta> *tileDeltas );
+
+	void					FinalizeTerrainColumn(	__in const TileCoordinate X,
+													__in const TileCoordinate firstRow,
+													__in const TileCoordinate lastRow,
+													__in_opt const DWORD *tileHashes,
+													__in const size_t tileHashStride,
+													__inout std::vector<TileDelta> *tileDeltas );
+	size_t					GetNumFinalizeThreads(	__in const size_t numColumns,
+													__in const size_t numRows ) const;
+
+	bool					IsLinkedToRowAbove(	__in const TileCoordinate X,
+												__in const TileCoordinate tileY );
+
+	size_t					GetNumCliffStackRows( void ) const;
+	//	Returns the number of entries rebuilt
+	size_t					RefreshCliffStackCache(	__in const TileRect &area );
+	void					UpdateCliffStackCache(	__in const TileCoordinate X,
+													__in const TileCoordinate firstChangedRow,
+													__in const TileCoordinate lastChangedRow );
+	TileCoordinate			GetCliffStackTop(	__in const TileCoordinate X,
+												__in const TileCoordinate tileY ) const;
 
 	DWORD			LastUndoID;
 
@@ -8,6 +8,11 @@
 //	These tables may be hardcoded, tool generated, or generated by code that is not implemented.
 #include "CIsoTables.h"
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#define ISOM_USE_SSE2
+#include <emmintrin.h>
+#endif
+
 
 
 
@@ -91,10 +96,14 @@ MapIsomData::MapIsomData( void )
 {
 	this->width = 0;
 	this->height = 0;
+	this->stride = 0;
+	this->guardBand = false;
+	this->origin = nullptr;
 
 	this->isomDataTbl			= nullptr;
 	this->isomDataTableLength	= 0;
 	this->matchPathCache		= nullptr;
+	this->matchDistanceCache	= nullptr;
 	this->tileToIsomTbl			= nullptr;
 	this->tileToIsomTableLength	= 0;
 }
@@ -103,20 +112,58 @@ MapIsomData::~MapIsomData( void )
 {
 	this->width = 0;
 	this->height = 0;
+	this->origin = nullptr;
 	this->data = nullptr;
 }
 
 HRESULT MapIsomData::Create(	__in const size_t mapWidth,
 								__in const size_t mapHeight )
+{
+	return this->Allocate( mapWidth, mapHeight, false );
+}
+
+HRESULT MapIsomData::CreateWithGuardBand(	__in const size_t mapWidth,
+											__in const size_t mapHeight )
+{
+	return this->Allocate( mapWidth, mapHeight, true );
+}
+
+HRESULT MapIsomData::Allocate(	__in const size_t mapWidth,
+								__in const size_t mapHeight,
+								__in const bool withGuardBand )
 {
 	HRESULT hr;
 
 	this->width  = MapIsomData::TileXPosToIsomXPos( mapWidth )  + 1;
 	this->height = MapIsomData::TileYPosToIsomYPos( mapHeight ) + 1;
+	this->guardBand = withGuardBand;
+
+	if (! withGuardBand)
+	{
+		this->stride = this->GetWidth();
+		hr = ALLOCATE_UNIQUEPTR_ARRAY( data, MapIsomData::IsomRect, this->GetWidth() * this->GetHeight() );
+		RETURNHRSILENT_IF_ERROR( hr );
+		::memset( this->data.get(), 0, sizeof(MapIsomData::IsomRect) * this->GetWidth() * this->GetHeight() );
+
+		this->origin = this->data.get();
+		return S_OK;
+	}
+
+	//	The right sentinel of a row doubles as the left sentinel of the next one,
+	//	and there is a sentinel row above and below the grid
+	const size_t alignment = MapIsomData::GUARD_BAND_ROW_ALIGNMENT;
+	this->stride = (this->GetWidth() + 1 + alignment - 1) / alignment * alignment;
 
-	hr = ALLOCATE_UNIQUEPTR_ARRAY( data, MapIsomData::IsomRect, this->GetWidth() * this->GetHeight() );
+	const size_t storageLength = (this->GetHeight() + 2) * this->stride + alignment;
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( data, MapIsomData::IsomRect, storageLength );
 	RETURNHRSILENT_IF_ERROR( hr );
-	::memset( this->data.get(), 0, sizeof(MapIsomData::IsomRect) * this->GetWidth() * this->GetHeight() );
+	::memset( this->data.get(), 0, sizeof(MapIsomData::IsomRect) * storageLength );
+
+	//	Start the rows on a cache line, leaving room for the sentinels at (-1, -1)
+	this->origin = this->data.get() + this->stride + 1;
+	const size_t misalignment = (reinterpret_cast<uintptr_t>( this->origin ) / sizeof(MapIsomData::IsomRect)) % alignment;
+	if (misalignment != 0)
+		this->origin += alignment - misalignment;
 
 	return S_OK;
 }
@@ -137,9 +184,15 @@ HRESULT MapIsomData::CopyFrom(	__inout MapIsomData *isomData,
 
 	for (TileCoordinate y=sourceRc.top;y < sourceRc.bottom;++y)
 	{
-		const MapIsomData::IsomRect *srcRow = isomData->data.get() + y * isomData->GetWidth() + sourceRc.left;
-		MapIsomData::IsomRect *destRow = this->data.get() + (y + yOffset) * this->GetWidth() + sourceRc.left + xOffset;
+		const MapIsomData::IsomRect *srcRow = isomData->GetIsomRect( sourceRc.left, y );
+		MapIsomData::IsomRect *destRow = this->GetIsomRect( sourceRc.left + xOffset, y + yOffset );
 		::memcpy( destRow, srcRow, sizeof(MapIsomData::IsomRect) * (sourceRc.right - sourceRc.left) );
+
+		//	The flags belong to the edits of the source map, not to this one
+		for (TileCoordinate x=0;x<sourceRc.right - sourceRc.left;++x)
+		{
+			destRow[x].ClearChanged();
+		}
 	}
 
 	return S_OK;
@@ -148,12 +201,17 @@ HRESULT MapIsomData::CopyFrom(	__inout MapIsomData *isomData,
 
 HRESULT MapIsomData::InitializeToValue(	__in const unsigned __int16 value )
 {
-	for (size_t i=0;i<this->GetWidth() * this->GetHeight(); ++i)
+	//	Leaves the guard band alone
+	for (size_t y=0;y<this->GetHeight();++y)
 	{
-		this->data[i].SetRawIsomValue(0, value);
-		this->data[i].SetRawIsomValue(1, value);
-		this->data[i].SetRawIsomValue(2, value);
-		this->data[i].SetRawIsomValue(3, value);
+		IsomRect *row = this->GetIsomRect( 0, y );
+		for (size_t x=0;x<this->GetWidth();++x)
+		{
+			row[x].SetRawIsomValue(0, value);
+			row[x].SetRawIsomValue(1, value);
+			row[x].SetRawIsomValue(2, value);
+			row[x].SetRawIsomValue(3, value);
+		}
 	}
 
 	return S_OK;
@@ -168,13 +226,18 @@ HRESULT MapIsomData::Load(	__in const size_t length,
 		return S_OK;
 	VERIFYARG( srcData );
 
-	//	Without endian fixes, all of this collapses to a memcpy
-	for (size_t i=0;i<this->GetWidth() * this->GetHeight(); ++i)
+	//	Without endian fixes, all of this collapses to a memcpy per row
+	for (size_t y=0;y<this->GetHeight();++y)
 	{
-		this->data[i].SetRawIsomValue(0, FixEndianWORD( srcData[i * 4 + 0] ) );
-		this->data[i].SetRawIsomValue(1, FixEndianWORD( srcData[i * 4 + 1] ) );
-		this->data[i].SetRawIsomValue(2, FixEndianWORD( srcData[i * 4 + 2] ) );
-		this->data[i].SetRawIsomValue(3, FixEndianWORD( srcData[i * 4 + 3] ) );
+		IsomRect *row = this->GetIsomRect( 0, y );
+		const unsigned __int16 *srcRow = srcData + y * this->GetWidth() * 4;
+		for (size_t x=0;x<this->GetWidth();++x)
+		{
+			row[x].SetRawIsomValue(0, FixEndianWORD( srcRow[x * 4 + 0] ) );
+			row[x].SetRawIsomValue(1, FixEndianWORD( srcRow[x * 4 + 1] ) );
+			row[x].SetRawIsomValue(2, FixEndianWORD( srcRow[x * 4 + 2] ) );
+			row[x].SetRawIsomValue(3, FixEndianWORD( srcRow[x * 4 + 3] ) );
+		}
 	}
 
 	return S_OK;
@@ -189,13 +252,18 @@ HRESULT MapIsomData::Save(	__in const size_t length,
 		return S_OK;
 	VERIFYARG( destData );
 
-	//	Without endian fixes, all of this collapses to a memcpy
-	for (size_t i=0;i<this->GetWidth() * this->GetHeight(); ++i)
+	//	Without endian fixes, all of this collapses to a memcpy per row
+	for (size_t y=0;y<this->GetHeight();++y)
 	{
-		destData[i * 4 + 0] = FixEndianWORD( this->data[i].GetRawIsomValue(0) );
-		destData[i * 4 + 1] = FixEndianWORD( this->data[i].GetRawIsomValue(1) );
-		destData[i * 4 + 2] = FixEndianWORD( this->data[i].GetRawIsomValue(2) );
-		destData[i * 4 + 3] = FixEndianWORD( this->data[i].GetRawIsomValue(3) );
+		const IsomRect *row = this->origin + y * this->GetStride();
+		unsigned __int16 *destRow = destData + y * this->GetWidth() * 4;
+		for (size_t x=0;x<this->GetWidth();++x)
+		{
+			destRow[x * 4 + 0] = FixEndianWORD( row[x].GetRawIsomValue(0) );
+			destRow[x * 4 + 1] = FixEndianWORD( row[x].GetRawIsomValue(1) );
+			destRow[x * 4 + 2] = FixEndianWORD( row[x].GetRawIsomValue(2) );
+			destRow[x * 4 + 3] = FixEndianWORD( row[x].GetRawIsomValue(3) );
+		}
 	}
 
 	return S_OK;
@@ -213,12 +281,15 @@ HRESULT MapIsomData::SetTilesetType(	__in const SCEngine::TilesetIndex tilesetID
 	this->tileToIsomTableLength	= (size_t)(TileSetIsomMatchingData[tilesetID][4]);
 
 	std::unique_ptr<IsomGroup[]> newMatchPathCache;
+	std::unique_ptr<IsomGroup[]> newMatchDistanceCache;
 	hr = this->GenerateMatchPathTable(	TileSetIsomMatchingData[tilesetID][1],
 										(size_t)(TileSetIsomMatchingData[tilesetID][4]),
-										&newMatchPathCache );
+										&newMatchPathCache,
+										&newMatchDistanceCache );
 	RETURNHRSILENT_IF_ERROR( hr );
 
 	this->matchPathCache = std::move( newMatchPathCache );
+	this->matchDistanceCache = std::move( newMatchDistanceCache );
 //	this->matchPathCacheSize = tileToIsomTableLength * tileToIsomTableLength;
 
 	return S_OK;
@@ -235,22 +306,32 @@ unsigned __int16 MapIsomData::GetIsomVal( __in const SCEngine::TileGroupID tileG
 
 HRESULT MapIsomData::GenerateMatchPathTable(	__in const DWORD *tileConnectionTable,
 												__in const size_t maxIsomValue,
-												__out std::unique_ptr<IsomGroup[]> *matchPathCache )
+												__out std::unique_ptr<IsomGroup[]> *matchPathCache,
+												__out std::unique_ptr<IsomGroup[]> *matchDistanceCache )
 {
 	HRESULT hr;
 	VERIFYPARG( matchPathCache );
+	VERIFYPARG( matchDistanceCache );
 	VERIFYARG( tileConnectionTable );
 	if (maxIsomValue > (std::numeric_limits<IsomGroup>::max)())
 		return E_INVALIDARG;
 
 	std::unique_ptr<IsomGroup[]> tempPathTable;
 	hr = ALLOCATE_UNIQUEPTR_ARRAY( tempPathTable, IsomGroup, maxIsomValue * maxIsomValue );
+	RETURNHRSILENT_IF_ERROR( hr );
 	::memset( tempPathTable.get(), 0, sizeof(IsomGroup) * maxIsomValue * maxIsomValue );
 
 	std::unique_ptr<IsomGroup[]> finalPathTable;
 	hr = ALLOCATE_UNIQUEPTR_ARRAY( finalPathTable, IsomGroup, maxIsomValue * maxIsomValue );
+	RETURNHRSILENT_IF_ERROR( hr );
 	::memset( finalPathTable.get(), 0, sizeof(IsomGroup) * maxIsomValue * maxIsomValue );
 
+	std::unique_ptr<IsomGroup[]> distanceTable;
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( distanceTable, IsomGroup, maxIsomValue * maxIsomValue );
+	RETURNHRSILENT_IF_ERROR( hr );
+	for (size_t i=0;i<maxIsomValue * maxIsomValue;++i)
+		distanceTable[i] = MATCH_DISTANCE_UNREACHABLE;
+
 	//	The connection table has connections per tile type 0 terminated,
 	//	and an empty row to signify the end of the table
 
@@ -273,39 +354,49 @@ HRESULT MapIsomData::GenerateMatchPathTable(	__in const DWORD *tileConnectionTab
 		++connectionTableSeeker;
 	}
 
-	std::unique_ptr<IsomGroup[]> rowCache;
-	hr = ALLOCATE_UNIQUEPTR_ARRAY( rowCache, IsomGroup, maxIsomValue );
+	//	Every group is queued at most once per search, so a flat array with a read index does as the queue
+	std::unique_ptr<IsomGroup[]> searchQueue;
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( searchQueue, IsomGroup, maxIsomValue );
+	RETURNHRSILENT_IF_ERROR( hr );
+
+	//	The first hop from the current source towards each group
+	std::unique_ptr<IsomGroup[]> firstHop;
+	hr = ALLOCATE_UNIQUEPTR_ARRAY( firstHop, IsomGroup, maxIsomValue );
 	RETURNHRSILENT_IF_ERROR( hr );
 
-	//	This loop takes the sets of tiles stored in the temp table in rows,
-	//	and expands them to touch all the columns they reference
+	//	Breadth first search from every group over the connections in the temp table.
+	//	The next hop row records which neighbor of the source each group was first reached through.
 	for (size_t i = maxIsomValue; i != 0; --i)
 	{
 		size_t curTile = i - 1;
 
-		//	The rowcache stores an expanded version of the transition ... maybe?
-		::memset( rowCache.get(), 0, sizeof(IsomGroup) * maxIsomValue );
+		::memset( firstHop.get(), 0, sizeof(IsomGroup) * maxIsomValue );
+
+		IsomGroup *finalPathTableRow	= finalPathTable.get() + curTile * maxIsomValue;
+		IsomGroup *distanceTableRow		= distanceTable.get() + curTile * maxIsomValue;
 
-		std::vector<IsomGroup>	crossTableStack;
-		crossTableStack.push_back( curTile );
-		finalPathTable[maxIsomValue*curTile+crossTableStack[0]] = curTile;
+		size_t queueHead = 0;
+		size_t queueTail = 0;
+		searchQueue[queueTail++] = static_cast<IsomGroup>( curTile );
+		finalPathTableRow[curTile] = static_cast<IsomGroup>( curTile );
+		distanceTableRow[curTile] = 0;
 
-		while (! crossTableStack.empty())
+		while (queueHead != queueTail)
 		{
-			IsomGroup curDestRow = crossTableStack.front(); crossTableStack.erase( crossTableStack.begin() );
+			IsomGroup curDestRow = searchQueue[queueHead++];
 
 			const IsomGroup* tempPathTableRow = tempPathTable.get() + curDestRow * maxIsomValue;
-			IsomGroup *finalPathTableRow      = finalPathTable.get() + curTile * maxIsomValue;
 			while (tempPathTableRow[0] != 0)
 			{
 				if (finalPathTableRow[tempPathTableRow[0]] == 0x00)
-				{					
-					IsomGroup nextVal = rowCache[curDestRow];
+				{
+					IsomGroup nextVal = firstHop[curDestRow];
 					if (nextVal == 0)
 						nextVal = tempPathTableRow[0];
-					crossTableStack.push_back( tempPathTableRow[0] );
 					finalPathTableRow[tempPathTableRow[0]] = nextVal;
-					rowCache[tempPathTableRow[0]] = nextVal;
+					distanceTableRow[tempPathTableRow[0]] = distanceTableRow[curDestRow] + 1;
+					firstHop[tempPathTableRow[0]] = nextVal;
+					searchQueue[queueTail++] = tempPathTableRow[0];
 				}
 				++tempPathTableRow;
 			}
@@ -313,29 +404,39 @@ HRESULT MapIsomData::GenerateMatchPathTable(	__in const DWORD *tileConnectionTab
 	}
 	
 	*matchPathCache = std::move( finalPathTable );
+	*matchDistanceCache = std::move( distanceTable );
 	return S_OK;
 }
 
+size_t MapIsomData::GetMatchDistance(	__in const IsomGroup fromGroup,
+										__in const IsomGroup toGroup ) const
+{
+	if (! this->matchDistanceCache || fromGroup >= this->GetNumIsomValues() || toGroup >= this->GetNumIsomValues())
+		return MATCH_DISTANCE_UNREACHABLE;
+
+	return this->matchDistanceCache[fromGroup * this->GetNumIsomValues() + toGroup];
+}
+
 
 
 MapIsomData::IsomRect* MapIsomData::GetIsomRect(	__in const size_t xPosition,
 													__in const size_t yPosition )
 {
-	return &this->data[xPosition + yPosition * this->GetWidth()];
+	return &this->origin[xPosition + yPosition * this->GetStride()];
 }
 
 
 unsigned __int16 MapIsomData::GetIsomValue(	__in const size_t xPosition,
 											__in const size_t yPosition )
 {
-	return this->data[xPosition + yPosition * this->GetWidth()].GetRawIsomValue( 0 ) >> 4;
+	return this->origin[xPosition + yPosition * this->GetStride()].GetRawIsomValue( 0 ) >> 4;
 }
 
 
 bool MapIsomData::GetIsomValueChanged(	__in const size_t xPosition,
 										__in const size_t yPosition )
 {
-	return this->data[xPosition + yPosition * this->GetWidth()].GetChanged();
+	return this->origin[xPosition + yPosition * this->GetStride()].GetChanged();
 }
 
 void MapIsomData::SetIsomValue(	__in const size_t xPosition,
@@ -343,8 +444,8 @@ void MapIsomData::SetIsomValue(	__in const size_t xPosition,
 								__in const size_t dirIndex,
 								__in const unsigned __int16 value )
 {
-	size_t nodeIndex = xPosition + yPosition * this->GetWidth();
-	this->data[nodeIndex].SetIsomValue( dirIndex, value );
+	size_t nodeIndex = xPosition + yPosition * this->GetStride();
+	this->origin[nodeIndex].SetIsomValue( dirIndex, value );
 }
 
 
@@ -352,7 +453,60 @@ void MapIsomData::SetIsomValueChanged(	__in const size_t xPosition,
 										__in const size_t yPosition,
 										__in const size_t dirIndex )
 {
-	size_t nodeIndex = xPosition + yPosition * this->GetWidth();
-	this->data[nodeIndex].SetIsomValueChanged( dirIndex );
+	size_t nodeIndex = xPosition + yPosition * this->GetStride();
+	this->origin[nodeIndex].SetIsomValueChanged( dirIndex );
 }
 
+
+HRESULT MapIsomData::FindDiamondsWithValue(	__in const IsomValue isomValue,
+											__out std::vector<POINT> *diamonds ) const
+{
+	VERIFYARG( diamonds );
+	diamonds->clear();
+
+	//	The value of the diamond at (x, y) lives in values[0] of that rect, above the direction and flag bits
+	const unsigned __int16 valueMask	= static_cast<unsigned __int16>( ~(IsomRect::ISOM_FLAG_SKIPPED | 0x000F) );
+	const unsigned __int16 maskedTarget	= static_cast<unsigned __int16>( isomValue << 4 );
+
+#ifdef ISOM_USE_SSE2
+	const __m128i valueMaskVec		= _mm_set1_epi16( static_cast<short>( valueMask ) );
+	const __m128i maskedTargetVec	= _mm_set1_epi16( static_cast<short>( maskedTarget ) );
+#endif
+
+	for (size_t y=0;y<this->GetHeight();++y)
+	{
+		const IsomRect *row = this->origin + y * this->GetStride();
+		size_t x = 0;
+
+#ifdef ISOM_USE_SSE2
+		//	Each load holds a pair of rects, and exactly one of them is a diamond position:
+		//	the first on even rows (byte 0 of the compare mask), the second on odd rows (byte 8).
+		const int diamondMaskBit = (y % 2) ? 0x0100 : 0x0001;
+		for (;x + 2 <= this->GetWidth();x += 2)
+		{
+			__m128i rectPair = _mm_loadu_si128( reinterpret_cast<const __m128i*>( row + x ) );
+			__m128i matches  = _mm_cmpeq_epi16( _mm_and_si128( rectPair, valueMaskVec ), maskedTargetVec );
+			if (_mm_movemask_epi8( matches ) & diamondMaskBit)
+			{
+				POINT diamondPt;
+				diamondPt.x = static_cast<LONG>( x + (y % 2) );
+				diamondPt.y = static_cast<LONG>( y );
+				diamonds->push_back( diamondPt );
+			}
+		}
+#endif
+
+		for (x += (x + y) % 2;x<this->GetWidth();x += 2)
+		{
+			if ((row[x].values[0] & valueMask) != maskedTarget)
+				continue;
+
+			POINT diamondPt;
+			diamondPt.x = static_cast<LONG>( x );
+			diamondPt.y = static_cast<LONG>( y );
+			diamonds->push_back( diamondPt );
+		}
+	}
+
+	return S_OK;
+}
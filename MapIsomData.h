@@ -44,20 +44,36 @@ public:
 private:
 	size_t					width;
 	size_t					height;
+	size_t					stride;		// Rects from one row to the next
+	bool					guardBand;
 public:
 	size_t					GetWidth( void ) const { return this->width; }
 	size_t					GetHeight( void ) const { return this->height; }
+	size_t					GetStride( void ) const { return this->stride; }
+	bool					HasGuardBand( void ) const { return this->guardBand; }
+
+	//	Guard band rows are padded to whole cache lines
+	static const size_t		GUARD_BAND_ROW_ALIGNMENT = 64 / sizeof(IsomRect);
 
 	static size_t			TileXPosToIsomXPos( __in const TileCoordinate xPosition) { return xPosition / 2; }
 	static size_t			TileYPosToIsomYPos( __in const TileCoordinate yPosition) { return yPosition; }
 
 protected:
 	std::unique_ptr<IsomRect[]>	data;
+	IsomRect				*origin;	// Rect (0, 0), inside data
+
+	HRESULT					Allocate(	__in const size_t mapWidth,
+										__in const size_t mapHeight,
+										__in const bool withGuardBand );
 
 public:
 	//	Create the actual data store for the isom matching data
 	HRESULT					Create(	__in const size_t mapWidth,
 									__in const size_t mapHeight );
+	//	Same, but with a border of empty sentinel rects around the grid. A sentinel has isom value 0,
+	//	so it never matches or gets enqueued, and diamond neighbors can be read without a bounds check.
+	HRESULT					CreateWithGuardBand(	__in const size_t mapWidth,
+													__in const size_t mapHeight );
 
 	HRESULT					CopyFrom(	__inout MapIsomData *isomData,
 										__in const __int32 xOffset,
@@ -80,9 +96,12 @@ public:
 	size_t					GetNumIsomValues( void ) const { return this->tileToIsomTableLength; }
 
 protected:
+	//	Runs a breadth first search from every isom group over the connection table,
+	//	producing the next hop and the hop count towards every other group.
 	HRESULT					GenerateMatchPathTable(	__in const DWORD *tileConnectionTable,
 													__in const size_t maxIsomValue,
-													__out std::unique_ptr<IsomGroup[]> *matchPathCache );
+													__out std::unique_ptr<IsomGroup[]> *matchPathCache,
+													__out std::unique_ptr<IsomGroup[]> *matchDistanceCache );
 
 public:
 	const DWORD				*isomDataTbl;
@@ -94,6 +113,15 @@ protected:
 public:
 	//	tileToIsomTableLength x tileToIsomTableLength table which contains connections between tile types.
 	std::unique_ptr<IsomGroup[]>	matchPathCache;
+	//	tileToIsomTableLength x tileToIsomTableLength table with the number of transitions between tile types.
+	//	Only read for the edge nodes of CIsoMap::EnqueueAreaSeam, whose ordering by it is still disabled.
+	std::unique_ptr<IsomGroup[]>	matchDistanceCache;
+
+	static const IsomGroup	MATCH_DISTANCE_UNREACHABLE = 0xFFFF;
+
+	//	Number of transitions to get from one isom group to another, or MATCH_DISTANCE_UNREACHABLE
+	size_t					GetMatchDistance(	__in const IsomGroup fromGroup,
+												__in const IsomGroup toGroup ) const;
 
 public:
 	IsomRect*				GetIsomRect(	__in const size_t xPosition,
@@ -110,5 +138,9 @@ public:
 	void					SetIsomValueChanged(	__in const size_t xPosition,
 													__in const size_t yPosition,
 													__in const size_t dirIndex );
+
+	//	Collects the position of every diamond with the given isom value, in row order
+	HRESULT					FindDiamondsWithValue(	__in const IsomValue isomValue,
+													__out std::vector<POINT> *diamonds ) const;
 };
 